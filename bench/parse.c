@@ -0,0 +1,287 @@
+// Parser throughput of the Lispy grammar, measured separately for parsing a
+// string with mpc_parse, parsing a file with mpc_parse_contents and turning
+// the resulting AST into lvals with lval_read. The grammar is timed both as
+// built by mpca_lang and after mpc_optimise_first lets `or` rules predict
+// their alternatives.
+//
+//   make bench/parse && ./bench/parse [options] [file.lspy]
+//
+//   --size BYTES     size of the generated source (default 512K)
+//   --depth N        deepest nesting of lists (default 4)
+//   --width N        items per list (default 4)
+//   --mix N:S:T:L:C  relative weights of numbers, symbols, strings, lists
+//                    and comments (default 1:1:1:2:0)
+//   --repeats N      times each measurement is repeated (default 10)
+//
+// Without a file a synthetic program is generated from the options above.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lispy.h"
+
+typedef struct {
+    mpc_parser_t* parsers[8];
+} grammar;
+
+static void grammar_new(grammar* g, int predict) {
+    char* names[] = { "number", "symbol", "string", "comment", "sexpr", "qexpr", "expr", "lispy" };
+    for (int i = 0; i < 8; i++) { g->parsers[i] = mpc_new(names[i]); }
+    mpca_lang(MPCA_LANG_DEFAULT, LISPY_GRAMMAR,
+        g->parsers[0], g->parsers[1], g->parsers[2], g->parsers[3],
+        g->parsers[4], g->parsers[5], g->parsers[6], g->parsers[7]);
+    if (predict) {
+        for (int i = 0; i < 8; i++) { mpc_optimise_first(g->parsers[i]); }
+    }
+}
+
+static void grammar_del(grammar* g) {
+    mpc_cleanup(8,
+        g->parsers[0], g->parsers[1], g->parsers[2], g->parsers[3],
+        g->parsers[4], g->parsers[5], g->parsers[6], g->parsers[7]);
+}
+
+// the shape of a generated program
+enum { TOK_NUMBER, TOK_SYMBOL, TOK_STRING, TOK_LIST, TOK_COMMENT, TOK_KINDS };
+
+typedef struct {
+    size_t size;
+    int depth;
+    int width;
+    int mix[TOK_KINDS];
+    unsigned seed;
+} shape;
+
+// append formatted text to a growing buffer
+static void emit(char** s, size_t* len, size_t* cap, const char* text) {
+    size_t n = strlen(text);
+    while (*len + n + 1 > *cap) {
+        *cap *= 2;
+        *s = realloc(*s, *cap);
+    }
+    memcpy(*s + *len, text, n + 1);
+    *len += n;
+}
+
+// pick a kind of token by the weights of the mix, with no lists past the
+// deepest nesting
+static int pick(shape* sh, int depth) {
+    int total = 0;
+    for (int k = 0; k < TOK_KINDS; k++) {
+        if (k == TOK_LIST && depth >= sh->depth) { continue; }
+        total += sh->mix[k];
+    }
+    if (total == 0) { return TOK_NUMBER; }
+
+    sh->seed = sh->seed * 1103515245 + 12345;
+    int r = (sh->seed >> 16) % total;
+    for (int k = 0; k < TOK_KINDS; k++) {
+        if (k == TOK_LIST && depth >= sh->depth) { continue; }
+        if (r < sh->mix[k]) { return k; }
+        r -= sh->mix[k];
+    }
+    return TOK_NUMBER;
+}
+
+static void generate_expr(char** s, size_t* len, size_t* cap, shape* sh, int depth) {
+    char text[64];
+    int kind = pick(sh, depth);
+    unsigned x = sh->seed;
+    switch (kind) {
+        case TOK_NUMBER: sprintf(text, "%d ", (int)(x >> 8) % 100000 - 500); break;
+        case TOK_SYMBOL: sprintf(text, "sym_%u ", (x >> 12) % 997); break;
+        case TOK_STRING: sprintf(text, "\"str \\\"%u\\\"\" ", (x >> 10) % 97); break;
+        case TOK_COMMENT: sprintf(text, "; note %u\n", (x >> 10) % 97); break;
+        default: {
+            int open = (x >> 20) & 1;
+            emit(s, len, cap, open ? "(" : "{");
+            for (int i = 0; i < sh->width; i++) { generate_expr(s, len, cap, sh, depth + 1); }
+            emit(s, len, cap, open ? ")\n" : "}\n");
+            return;
+        }
+    }
+    emit(s, len, cap, text);
+}
+
+static char* generate(shape* sh) {
+    size_t len = 0, cap = 1024;
+    char* s = malloc(cap);
+    s[0] = '\0';
+    while (len < sh->size) {
+        emit(&s, &len, &cap, "(def {f} (\\ {x y} {");
+        generate_expr(&s, &len, &cap, sh, 0);
+        emit(&s, &len, &cap, "}))\n");
+    }
+    return s;
+}
+
+static char* read_file(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) { return NULL; }
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* s = malloc(n + 1);
+    s[fread(s, 1, n, f)] = '\0';
+    fclose(f);
+    return s;
+}
+
+static double seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// seconds spent parsing `input` `repeats` times, or -1 on a parse error
+static double run_parse(grammar* g, const char* input, int repeats) {
+    clock_t start = clock();
+    for (int i = 0; i < repeats; i++) {
+        mpc_result_t r;
+        if (!mpc_parse("<bench>", input, g->parsers[7], &r)) {
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+            return -1;
+        }
+        mpc_ast_delete(r.output);
+    }
+    return seconds(start);
+}
+
+// seconds spent reading and parsing a file `repeats` times
+static double run_parse_contents(grammar* g, const char* filename, int repeats) {
+    clock_t start = clock();
+    for (int i = 0; i < repeats; i++) {
+        mpc_result_t r;
+        if (!mpc_parse_contents(filename, g->parsers[7], &r)) {
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+            return -1;
+        }
+        mpc_ast_delete(r.output);
+    }
+    return seconds(start);
+}
+
+// seconds spent converting the AST of `input` to lvals `repeats` times,
+// leaving out the parse and the deletes
+static double run_read(grammar* g, const char* input, int repeats) {
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", input, g->parsers[7], &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return -1;
+    }
+
+    double total = 0;
+    for (int i = 0; i < repeats; i++) {
+        clock_t start = clock();
+        lval* v = lval_read(r.output);
+        total += seconds(start);
+        lval_del(v);
+    }
+
+    mpc_ast_delete(r.output);
+    return total;
+}
+
+static void print_rate(const char* label, double mb, double t, int repeats) {
+    printf("%-28s %8.2f ms %8.2f MB/s\n", label, 1000 * t / repeats, mb / t);
+}
+
+int main(int argc, char* argv[]) {
+    shape sh = { 512 * 1024, 4, 4, { 1, 1, 1, 2, 0 }, 42 };
+    int repeats = 10;
+    char* filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            sh.size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            sh.depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            sh.width = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            int* m = sh.mix;
+            if (sscanf(argv[++i], "%d:%d:%d:%d:%d", &m[0], &m[1], &m[2], &m[3], &m[4]) < 4) {
+                fprintf(stderr, "--mix expects N:S:T:L[:C]\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--repeats") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (repeats < 1) { repeats = 1; }
+
+    char* input = filename ? read_file(filename) : generate(&sh);
+    if (!input) {
+        fprintf(stderr, "Could not read '%s'\n", filename);
+        return 1;
+    }
+
+    // mpc_parse_contents needs the generated program in a file
+    char path[] = "/tmp/lispy-parse-XXXXXX";
+    char* contents = filename;
+    if (!filename) {
+        int fd = mkstemp(path);
+        FILE* f = fd < 0 ? NULL : fdopen(fd, "w");
+        if (!f) {
+            perror("bench/parse");
+            free(input);
+            return 1;
+        }
+        fputs(input, f);
+        fclose(f);
+        contents = path;
+    }
+
+    double mb = (double)strlen(input) * repeats / (1024 * 1024);
+
+    if (filename) {
+        printf("input: %s, %lu bytes, %d repeats\n",
+            filename, (unsigned long)strlen(input), repeats);
+    } else {
+        printf("input: <generated>, %lu bytes, depth %d, width %d, mix %d:%d:%d:%d:%d, %d repeats\n",
+            (unsigned long)strlen(input), sh.depth, sh.width,
+            sh.mix[0], sh.mix[1], sh.mix[2], sh.mix[3], sh.mix[4], repeats);
+    }
+
+    double parse[2];
+    int failed = 0;
+    char* labels[] = { "mpca_lang", "predicted" };
+
+    for (int k = 0; k < 2 && !failed; k++) {
+        grammar g;
+        grammar_new(&g, k);
+        char label[64];
+
+        parse[k] = run_parse(&g, input, repeats);
+        double file = parse[k] < 0 ? -1 : run_parse_contents(&g, contents, repeats);
+        if (parse[k] < 0 || file < 0) { failed = 1; }
+        else {
+            sprintf(label, "%s mpc_parse", labels[k]);
+            print_rate(label, mb, parse[k], repeats);
+            sprintf(label, "%s mpc_parse_contents", labels[k]);
+            print_rate(label, mb, file, repeats);
+        }
+
+        // the AST is the same whichever grammar built it
+        if (k == 1 && !failed) {
+            double read = run_read(&g, input, repeats);
+            if (read < 0) { failed = 1; }
+            else { print_rate("lval_read", mb, read, repeats); }
+        }
+        grammar_del(&g);
+    }
+
+    if (!failed) { printf("speedup      %8.2fx\n", parse[0] / parse[1]); }
+
+    if (!filename) { unlink(path); }
+    free(input);
+    return failed;
+}
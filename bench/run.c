@@ -0,0 +1,180 @@
+// Benchmark suite: runs a fixed corpus of Lispy programs and reports, for
+// each one, the median and 99th percentile wall time of a run, the lvals it
+// allocates and the peak resident memory, as JSON so results of different
+// versions can be kept and compared.
+//
+//   make bench                  writes bench/results.json
+//   ./bench/run [iterations]    writes JSON to stdout
+//
+// Every benchmark runs in its own process so its peak RSS is its own.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../lispy.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define PRELUDE "(def {fun} (\\ {f b} {def (head f) (\\ (tail f) b)}))\n"
+
+typedef struct {
+    char* name;
+    char* setup;    // evaluated once, untimed
+    char* run;      // evaluated and timed once per sample
+    int scale;      // samples per iteration, for runs too short to time alone
+} bench;
+
+// the "load" run is filled in once its file has been generated
+static char load_run[256];
+
+static bench corpus[] = {
+    { "fib",
+      PRELUDE "(fun {fib n} {if (<= n 1) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+      "(fib 18)", 1 },
+    { "list-build",
+      PRELUDE "(fun {range a b} {if (>= a b) {{}} {join (list a) (range (+ a 1) b)}})",
+      "(range 0 500)", 1 },
+    { "list-join",
+      PRELUDE "(fun {chunks n} {if (== n 0) {{}} {join {1 2 3 4 5 6 7 8 9 10} (chunks (- n 1))}})",
+      "(len (chunks 100))", 1 },
+    // there is no string concatenation, so strings are built with show
+    { "strings",
+      PRELUDE "(fun {strs n} {if (== n 0) {{}} {join (list (show {n \"n\\t\"})) (strs (- n 1))}})",
+      "(show (strs 300))", 1 },
+    { "deep-recursion",
+      PRELUDE "(fun {down n} {if (== n 0) {0} {+ 1 (down (- n 1))}})",
+      "(down 1000)", 1 },
+    { "load", NULL, load_run, 1 },
+    { "repl-line",
+      "(def {x} 10)",
+      "(+ x (* 2 (- x 3)))", 1000 },
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int by_value(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// write a large source file of definitions for the "load" benchmark,
+// returning its name
+static char* generate_load(void) {
+    static char path[] = "/tmp/lispy-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { return NULL; }
+    FILE* f = fdopen(fd, "w");
+    for (int i = 0; i < 2000; i++) {
+        fprintf(f, "(def {v%d} {%d (sym_%d %d) \"str %d\" {a {b c}}}) ; entry %d\n",
+            i % 100, i, i % 997, -i, i, i);
+    }
+    fclose(f);
+    snprintf(load_run, sizeof(load_run), "(load \"%s\")", path);
+    return path;
+}
+
+// function to evaluate source, reporting any error; returns 0 on failure
+static int eval(interp* in, bench* b, char* input) {
+    lval* v = interp_eval_string(in, "<bench>", input);
+    int ok = lval_type(v) != LVAL_ERR;
+    if (!ok) { fprintf(stderr, "%s: %s\n", b->name, lval_to_str(v)); }
+    lval_del(v);
+    return ok;
+}
+
+// run one benchmark and print its results as a JSON object
+static int run(bench* b, int iterations) {
+    interp* in = interp_new();
+    if (b->setup && !eval(in, b, b->setup)) { return 1; }
+
+    int n = iterations * b->scale;
+    double* samples = malloc(sizeof(double) * n);
+    unsigned long allocs = lispy_mem_allocated();
+
+    for (int i = 0; i < n; i++) {
+        double start = now_ms();
+        if (!eval(in, b, b->run)) { return 1; }
+        samples[i] = now_ms() - start;
+    }
+
+    allocs = lispy_mem_allocated() - allocs;
+    interp_del(in);
+
+    double total = 0;
+    for (int i = 0; i < n; i++) { total += samples[i]; }
+    qsort(samples, n, sizeof(double), by_value);
+    double median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    int p99 = (int)(0.99 * n + 0.999999) - 1;
+    if (p99 < 0) { p99 = 0; }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("    {\"name\": \"%s\", \"samples\": %d, \"median_ms\": %.4f, "
+        "\"p99_ms\": %.4f, \"mean_ms\": %.4f, \"allocs_per_run\": %lu, "
+        "\"peak_rss_kb\": %ld}",
+        b->name, n, median, samples[p99], total / n, allocs / n, ru.ru_maxrss);
+    fprintf(stderr, "%-16s median %10.4f ms   p99 %10.4f ms   %10lu allocs   %8ld KB\n",
+        b->name, median, samples[p99], allocs / n, ru.ru_maxrss);
+
+    free(samples);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    if (iterations < 1) { iterations = 1; }
+    lispy_mem_start();
+
+    char* load_path = generate_load();
+    if (!load_path) {
+        perror("bench: cannot write the load benchmark's file");
+        return 1;
+    }
+
+    printf("{\n  \"version\": \"%s\",\n  \"iterations\": %d,\n  \"benchmarks\": [\n",
+        BENCH_VERSION, iterations);
+
+    int failed = 0;
+    int count = sizeof(corpus) / sizeof(corpus[0]);
+    for (int i = 0; i < count; i++) {
+        if (i) { printf(",\n"); }
+        fflush(stdout);
+
+        // run in a child so each benchmark's peak RSS is measured alone
+        pid_t pid = fork();
+        if (pid == 0) {
+            // exit rather than _exit, so an instrumented build writes its
+            // profile; stdout was flushed before the fork
+            exit(run(&corpus[i], iterations));
+        }
+
+        int status = 1;
+        if (pid < 0) { status = run(&corpus[i], iterations); }
+        else if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) { status = 1; }
+        else { status = WEXITSTATUS(status); }
+
+        if (status) {
+            printf("    {\"name\": \"%s\", \"error\": true}", corpus[i].name);
+            failed = 1;
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    unlink(load_path);
+    return failed;
+}
@@ -0,0 +1,4365 @@
+// for syscall, to get a thread's id in the sampler's signal handler, and
+// pthread_getattr_np, to find the bounds of a thread's stack
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mpc.h"
+#include "lispy.h"
+#include "pool.h"
+
+#if defined(_MSC_VER)
+#define LTHREAD_LOCAL __declspec(thread)
+#else
+#define LTHREAD_LOCAL __thread
+#endif
+
+// where this thread prints values, stdout unless redirected
+static LTHREAD_LOCAL FILE* lval_out = NULL;
+
+// a scoped evaluation, see interp_eval_scoped, which the futures and
+// actors it starts run in too
+typedef struct {
+    FILE* out;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    long jobs;      // futures and actor turns queued or running
+} lscope;
+
+// the scoped evaluation this thread is working for, if any
+static LTHREAD_LOCAL lscope* lval_scope = NULL;
+
+#define LOUT (lval_scope ? lval_scope->out : lval_out ? lval_out : stdout)
+
+// function to count a job started for a scope
+static void lscope_hold(lscope* s) {
+    if (!s) { return; }
+    pthread_mutex_lock(&s->lock);
+    s->jobs++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// function to count a job of a scope as finished; the scope may be gone
+// once this returns
+static void lscope_release(lscope* s) {
+    if (!s) { return; }
+    pthread_mutex_lock(&s->lock);
+    if (--s->jobs == 0) { pthread_cond_broadcast(&s->idle); }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// lvals this thread has allocated and freed, for the profiler and limits
+static LTHREAD_LOCAL unsigned long lval_allocs = 0;
+static LTHREAD_LOCAL unsigned long lval_frees = 0;
+
+// bytes of lvals, their strings and their lists of cells this thread has
+// allocated less those it has freed, for the heap limit
+static LTHREAD_LOCAL long lval_bytes = 0;
+
+// what an evaluation has used of its interpreter's limits, see lbudget_begin
+typedef struct lbudget lbudget;
+
+static void lbudget_unref(lbudget* b);
+
+// what lvals are allocated for: evaluation, reading source, copying a value
+// out of an environment or into one, other copies, and builtins' own work
+enum { LMEM_EVAL, LMEM_READ, LMEM_LOOKUP, LMEM_BIND, LMEM_COPY, LMEM_BUILTIN, LMEM_OPS };
+
+static const char* lmem_op_names[LMEM_OPS] = {
+    "eval", "read", "lookup", "bind", "copy", "builtin"
+};
+
+#define LVAL_TYPES (LVAL_ACTOR + 1)
+
+// one thread's allocation counters, kept for the life of the process; only
+// that thread writes them, so they are bumped without a locked instruction
+typedef struct lmemtab {
+    unsigned long allocs[LMEM_OPS][LVAL_TYPES];
+    unsigned long frees;
+    struct lmemtab* next;
+} lmemtab;
+
+#define LMEM_BUMP(c) \
+    __atomic_store_n(&(c), __atomic_load_n(&(c), __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED)
+
+// whether allocations are being counted, see lispy_mem_start
+static int lmem_on = 0;
+
+static pthread_mutex_t lmem_lock = PTHREAD_MUTEX_INITIALIZER;
+static lmemtab* lmem_tabs = NULL;
+static LTHREAD_LOCAL lmemtab* lmem_tab = NULL;
+static LTHREAD_LOCAL int lmem_op = LMEM_EVAL;
+
+// function to get this thread's counters
+static lmemtab* lmem_thread(void) {
+    if (!lmem_tab) {
+        lmemtab* t = calloc(1, sizeof(lmemtab));
+        pthread_mutex_lock(&lmem_lock);
+        t->next = lmem_tabs;
+        lmem_tabs = t;
+        pthread_mutex_unlock(&lmem_lock);
+        lmem_tab = t;
+    }
+    return lmem_tab;
+}
+
+// function to count this thread's allocations against op until
+// lmem_leave is given the returned previous op
+static int lmem_enter(int op) {
+    int old = lmem_op;
+    lmem_op = op;
+    return old;
+}
+
+static void lmem_leave(int old) { lmem_op = old; }
+
+// macros
+#define LASSERT(args, cond, fmt, ...) \
+if (!(cond)) { \
+    lval* err = lval_err(fmt, ##__VA_ARGS__); \
+    lval_del(args); \
+    return err; \
+}
+
+#define LASSERT_TYPE(func, args, index, expected) \
+    LASSERT(args, args->cell[index]->type == expected, \
+        "function '%s' passed incorrect type for argument %i " \
+        "(got '%s', expected: '%s')", \
+        func, index, ltype_name(args->cell[index]->type), ltype_name(expected));
+
+#define LASSERT_NUM(func, args, expected) \
+    LASSERT(args, args->count == expected, \
+        "function '%s' was passed incorrect number of arguments" \
+        "(got %i, expected: %i)", \
+        func, args->count, expected);
+
+#define LASSERT_NOT_EMPTY(func, args, index) \
+    LASSERT(args, args->cell[index]->count != 0, \
+        "function '%s' was passed {} for argument %i", \
+        func, index);
+
+// function to create an lenv
+lenv* lenv_new(void) {
+    lenv* e = malloc(sizeof(lenv));
+    e->par = NULL;
+    e->top = 0;
+    e->count = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    return e;
+}
+
+// function to delete an lenv
+void lenv_del(lenv* e) {
+    for (int i = 0; i < e->count; i++) {
+        free(e->syms[i]);
+        lval_del(e->vals[i]);
+    }
+    free(e->syms);
+    free(e->vals);
+    free(e);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    // walk out through the parents in a loop, as the chain is as long as
+    // the calls under way
+    for (; e; e = e->par) {
+        // iterate over all items in environment
+        for (int i = 0; i < e->count; i++) {
+            // check if the stored string matches the symbol string
+            // if it does, return a copy of the value
+            if (strcmp(e->syms[i], k->sym) == 0) {
+                int op = lmem_enter(LMEM_LOOKUP);
+                lval* x = lval_copy(e->vals[i]);
+                lmem_leave(op);
+                return x;
+            }
+        }
+    }
+    // if no symbol found return error
+    return lval_err("unbound symbol '%s'", k->sym);
+}
+
+
+// function to put functions in the local environment
+void lenv_put(lenv* e, lval* k, lval* v) {
+    int op = lmem_enter(LMEM_BIND);
+
+    // iterate over all items in environment
+    // this is to see if variable already exists
+    for (int i = 0; i < e->count; i++) {
+        // if variable is found, delete item at this position
+        // and replace with variable supplied by user
+        if (strcmp(e->syms[i], k->sym) == 0) {
+            lval_del(e->vals[i]);
+            e->vals[i] = lval_copy(v);
+            lmem_leave(op);
+            return;
+        }
+    }
+
+    // if no existing entry found allocate space for new entry
+    e->count++;
+    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+    e->syms = realloc(e->syms, sizeof(lval*) * e->count);
+
+    // copy contents of lval and symbol string into new location
+    e->vals[e->count - 1] = lval_copy(v);
+    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
+    strcpy(e->syms[e->count - 1], k->sym);
+    lmem_leave(op);
+}
+
+
+// function to put functions in the global environment
+void lenv_def(lenv* e, lval* k, lval* v) {
+    // iterate until 'e' has no parent, or defines for its children
+    while (e->par && !e->top)
+        e = e->par;
+    // put value in e
+    lenv_put(e, k, v);
+}
+
+
+// function to copy an environment and its parents into a single root
+// environment, inner definitions shadowing outer ones
+lenv* lenv_flatten(lenv* e) {
+    lenv* n = lenv_new();
+    for (; e; e = e->par) {
+        for (int i = 0; i < e->count; i++) {
+            // skip symbols already defined further in
+            int found = 0;
+            for (int j = 0; j < n->count && !found; j++) {
+                found = strcmp(n->syms[j], e->syms[i]) == 0;
+            }
+            if (found) { continue; }
+
+            lval* k = lval_sym(e->syms[i]);
+            lenv_put(n, k, e->vals[i]);
+            lval_del(k);
+        }
+    }
+    return n;
+}
+
+
+// function to copy environments
+lenv* lenv_copy(lenv* e) {
+    lenv* n = malloc(sizeof(lenv));
+    n->par = e->par;
+    n->top = e->top;
+    n->count = e->count;
+    n->syms = malloc(sizeof(char*) * n->count);
+    n->vals = malloc(sizeof(lval*) * n->count);
+    for (int i = 0; i < n->count; i++) {
+        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+        strcpy(n->syms[i], e->syms[i]);
+        n->vals[i] = lval_copy(e->vals[i]);
+    }
+    return n;
+}
+
+// function to allocate an lval of the given type, counting it
+lval* lval_new(int type) {
+    lval* v = malloc(sizeof(lval));
+    v->type = type;
+    lval_allocs++;
+    lval_bytes += sizeof(lval);
+    if (__atomic_load_n(&lmem_on, __ATOMIC_RELAXED)) {
+        LMEM_BUMP(lmem_thread()->allocs[lmem_op][type]);
+    }
+    return v;
+}
+
+// function to create a new number type lval
+lval* lval_num(long x) {
+    lval* v = lval_new(LVAL_NUM);
+    v->num = x;
+    return v;
+}
+
+// construct a pointer to a new error type lval
+lval* lval_err(char* fmt, ...) {
+    lval* v = lval_new(LVAL_ERR);
+
+    // create a va list and initialize it
+    va_list va;
+    va_start(va, fmt);
+
+    // allocate 512 bytes of space
+    v->err = malloc(512);
+
+    // print the error string with a maximum of 511 characters
+    vsnprintf(v->err, 511, fmt, va);
+
+    // reallocate to number of bytes actually used
+    v->err = realloc(v->err, strlen(v->err) + 1);
+    lval_bytes += strlen(v->err) + 1;
+
+    // cleanup our va list
+    va_end(va);
+
+    return v;
+}
+
+// function to construct a user-defined 'lval' function
+lval* lval_lambda(lval* formals, lval* body) {
+    lval* v = lval_new(LVAL_FUN);
+
+    // set builtin to Null
+    v->builtin = NULL;
+    v->name = NULL;
+
+    // build the new environment
+    v->env = lenv_new();
+
+    // set formal and body
+    v->formals = formals;
+    v->body = body;
+
+    return v;
+}
+
+// function which maps a function to its string representation
+char* ltype_name(int t) {
+    switch(t) {
+        case LVAL_FUN: return "Function";
+        case LVAL_NUM: return "Number";
+        case LVAL_ERR: return "Error";
+        case LVAL_SYM: return "Symbol";
+        case LVAL_STR: return "String";
+        case LVAL_FUT: return "Future";
+        case LVAL_ACTOR: return "Actor";
+        case LVAL_SEXPR: return "S-Expression";
+        case LVAL_QEXPR: return "Q-Expression";
+        default: return "Unknown";
+    }
+}
+
+// construct a pointer to new Symbol lval
+lval* lval_sym(char* s) {
+    lval* v = lval_new(LVAL_SYM);
+    v->sym = malloc(strlen(s) + 1);
+    strcpy(v->sym, s);
+    lval_bytes += strlen(s) + 1;
+    return v;
+}
+
+
+// construct a pointer to a new String lval
+lval* lval_str(char* s) {
+    lval* v = lval_new(LVAL_STR);
+    v->str = malloc(strlen(s) + 1);
+    strcpy(v->str, s);
+    lval_bytes += strlen(s) + 1;
+    return v;
+}
+
+
+// construct a pointer to a new empty Sexpr lval
+lval* lval_sexpr(void) {
+    lval* v = lval_new(LVAL_SEXPR);
+    v->count = 0;
+    v->cell = NULL;
+return v;
+}
+
+lval* lval_qexpr(void) {
+    lval* v = lval_new(LVAL_QEXPR);
+    v->count = 0;
+    v->cell = NULL;
+    return v;
+}
+
+lval* lval_fun(lbuiltin func) {
+    lval* v = lval_new(LVAL_FUN);
+    v->builtin = func;
+    v->name = NULL;
+    return v;
+}
+
+// states of a future
+enum { LFUT_PENDING, LFUT_RUNNING, LFUT_DONE };
+
+// a spawned evaluation; every lval holding the future and the queued job
+// each own one reference
+struct lfuture {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int refs;
+    int state;
+    interp* in;
+    lenv* env;      // snapshot of the spawning environment
+    lscope* scope;  // the scoped evaluation that spawned it, if any
+    lbudget* budget;    // the budget of the evaluation that spawned it, if any
+    lval* expr;     // expression still to evaluate
+    lval* result;   // its value once done
+};
+
+static lfuture* lfuture_ref(lfuture* f) {
+    pthread_mutex_lock(&f->lock);
+    f->refs++;
+    pthread_mutex_unlock(&f->lock);
+    return f;
+}
+
+static void lfuture_unref(lfuture* f) {
+    pthread_mutex_lock(&f->lock);
+    int refs = --f->refs;
+    pthread_mutex_unlock(&f->lock);
+    if (refs) { return; }
+
+    if (f->env) { lenv_del(f->env); }
+    if (f->expr) { lval_del(f->expr); }
+    if (f->result) { lval_del(f->result); }
+    lbudget_unref(f->budget);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->done);
+    free(f);
+}
+
+// construct an actor lval; the handle does not own the actor
+lval* lval_actor(lactor* a) {
+    lval* v = lval_new(LVAL_ACTOR);
+    v->actor = a;
+    return v;
+}
+
+// construct a future lval, taking over a reference to f
+lval* lval_fut(lfuture* f) {
+    lval* v = lval_new(LVAL_FUT);
+    v->fut = f;
+    return v;
+}
+
+// function to start an empty stack of steps
+void lstack_init(lstack* s) {
+    s->count = 0;
+    s->cap = LSTACK_LOCAL;
+    s->steps = s->local;
+}
+
+// function to push a step, moving the stack onto the heap once it
+// outgrows the local array
+void lstack_push(lstack* s, lval* v, lval* w, mpc_ast_t* t, char c) {
+    if (s->count == s->cap) {
+        s->cap *= 2;
+        if (s->steps == s->local) {
+            s->steps = malloc(sizeof(lstep) * s->cap);
+            memcpy(s->steps, s->local, sizeof(lstep) * s->count);
+        } else {
+            s->steps = realloc(s->steps, sizeof(lstep) * s->cap);
+        }
+    }
+    lstep step = { v, w, t, c };
+    s->steps[s->count++] = step;
+}
+
+// function to take the most recently pushed step
+lstep lstack_pop(lstack* s) {
+    return s->steps[--s->count];
+}
+
+// function to free a stack that moved onto the heap
+void lstack_free(lstack* s) {
+    if (s->steps != s->local) { free(s->steps); }
+}
+
+// function to delete an lval and everything nested inside it
+void lval_del(lval* v) {
+    lstack s;
+    lstack_init(&s);
+    lstack_push(&s, v, NULL, NULL, 0);
+
+    while (s.count) {
+        v = lstack_pop(&s).v;
+
+        switch (v->type) {
+            case LVAL_NUM:
+                break;
+
+            case LVAL_ERR:
+                lval_bytes -= strlen(v->err) + 1;
+                free(v->err);
+                break;
+
+            case LVAL_SYM:
+                lval_bytes -= strlen(v->sym) + 1;
+                free(v->sym);
+                break;
+
+            case LVAL_STR:
+                lval_bytes -= strlen(v->str) + 1;
+                free(v->str);
+                break;
+
+            // queue the cells instead of recursing into them
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                for (int i = 0; i < v->count; i++)
+                    lstack_push(&s, v->cell[i], NULL, NULL, 0);
+                lval_bytes -= sizeof(lval*) * v->count;
+                free(v->cell);
+                break;
+
+            case LVAL_FUN:
+                if (!v->builtin) {
+                    lenv_del(v->env);
+                    lstack_push(&s, v->formals, NULL, NULL, 0);
+                    lstack_push(&s, v->body, NULL, NULL, 0);
+                }
+                break;
+
+            case LVAL_FUT:
+                lfuture_unref(v->fut);
+                break;
+
+            // actors belong to the interpreter
+            case LVAL_ACTOR:
+                break;
+        }
+
+        free(v);
+        lval_frees++;
+        lval_bytes -= sizeof(lval);
+        if (__atomic_load_n(&lmem_on, __ATOMIC_RELAXED)) { LMEM_BUMP(lmem_thread()->frees); }
+    }
+
+    lstack_free(&s);
+}
+
+// function to convert an AST node to a number lval
+lval* lval_read_num(mpc_ast_t* t) {
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+        return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+}
+
+
+// function to read a string
+lval* lval_read_str(mpc_ast_t* t) {
+    // remove final quote character
+    t->contents[strlen(t->contents) - 1] = '\0';
+    // copy string without first quote
+    char* unescaped = malloc(strlen(t->contents + 1) + 1);
+    strcpy(unescaped, t->contents + 1);
+    // pass through unescape function
+    unescaped = mpcf_unescape(unescaped);
+    // construct a new lval using the string
+    lval* str = lval_str(unescaped);
+    // free string and return
+    free(unescaped);
+    return str;
+}
+
+// function to add an AST element to the list of element
+lval* lval_add(lval* v, lval* x) {
+    v->count++;
+    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    lval_bytes += sizeof(lval*);
+    v->cell[v->count - 1] = x;
+    return v;
+}
+
+// this function converts a single AST node to an lval, lists are
+// returned empty and filled in by lval_read
+lval* lval_read_node(mpc_ast_t* t) {
+    // if String, Symbol or Number return conversion to this type
+    if (strstr(t->tag, "string")) { return lval_read_str(t); }
+    if (strstr(t->tag, "number")) { return lval_read_num(t); }
+    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+
+    // if root (>) or sexpr or qexpr then create empty list
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+    return x;
+}
+
+// this function converts an AST node and its children to an lval,
+// nested lists are kept on an explicit stack rather than recursed into
+lval* lval_read(mpc_ast_t* t) {
+    int op = lmem_enter(LMEM_READ);
+    lval* root = lval_read_node(t);
+
+    lstack s;
+    lstack_init(&s);
+    lstack_push(&s, root, NULL, t, 0);
+
+    while (s.count) {
+        lstep step = lstack_pop(&s);
+        lval* x = step.v;
+        t = step.t;
+
+        // only lists have anything inside to read
+        if (!x || (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR)) { continue; }
+
+        // fill this list with any valid expression contained within
+        for (int i = 0; i < t->children_num; i++) {
+            // we simply ignore comments
+            if (strcmp(t->children[i]->contents, "(") == 0) {continue;}
+            if (strcmp(t->children[i]->contents, ")") == 0) {continue;}
+            if (strcmp(t->children[i]->contents, "{") == 0) {continue;}
+            if (strcmp(t->children[i]->contents, "}") == 0) {continue;}
+            if (strcmp(t->children[i]->tag, "regex") == 0) {continue;}
+            if (strstr(t->children[i]->tag, "comment")) {continue;}
+            lval* y = lval_read_node(t->children[i]);
+            x = lval_add(x, y);
+            lstack_push(&s, y, NULL, t->children[i], 0);
+        }
+    }
+
+    lstack_free(&s);
+    lmem_leave(op);
+    return root;
+}
+
+// function to start an empty buffer using its local storage
+void lbuf_init(lbuf* b) {
+    b->data = b->local;
+    b->len = 0;
+    b->cap = LBUF_LOCAL;
+}
+
+// function to make room for n more characters
+void lbuf_reserve(lbuf* b, size_t n) {
+    if (b->len + n <= b->cap) { return; }
+    while (b->len + n > b->cap) { b->cap *= 2; }
+    if (b->data == b->local) {
+        b->data = malloc(b->cap);
+        memcpy(b->data, b->local, b->len);
+    } else {
+        b->data = realloc(b->data, b->cap);
+    }
+}
+
+void lbuf_free(lbuf* b) {
+    if (b->data != b->local) { free(b->data); }
+}
+
+void lbuf_write(lbuf* b, const char* s, size_t n) {
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+void lbuf_putc(lbuf* b, char c) {
+    lbuf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf* b, const char* s) { lbuf_write(b, s, strlen(s)); }
+
+// function to write a number in decimal without going through printf
+void lbuf_num(lbuf* b, long x) {
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    do {
+        digits[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (x < 0) { digits[--i] = '-'; }
+    lbuf_write(b, digits + i, sizeof(digits) - i);
+}
+
+// the letter after the backslash for characters printed escaped, as mpc's
+// C string escapes
+static const char lbuf_escapes[256] = {
+    ['\a'] = 'a', ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r',
+    ['\t'] = 't', ['\v'] = 'v', ['\\'] = '\\', ['\''] = '\'', ['"'] = '"',
+};
+
+// function to write a string escaped, copying unescaped runs in one go
+void lbuf_escape(lbuf* b, const char* s) {
+    const char* run = s;
+    for (; *s; s++) {
+        char e = lbuf_escapes[(unsigned char)*s];
+        if (!e) { continue; }
+        lbuf_write(b, run, s - run);
+        char pair[2] = { '\\', e };
+        lbuf_write(b, pair, 2);
+        run = s + 1;
+    }
+    lbuf_write(b, run, s - run);
+}
+
+
+// function to queue the cells of a list between its brackets
+void lval_expr_print(lbuf* b, lstack* s, lval* v, char open, char close) {
+    lbuf_putc(b, open);
+    lstack_push(s, NULL, NULL, NULL, close);
+    for (int i = v->count - 1; i >= 0; i--) {
+        // print value contained within
+        lstack_push(s, v->cell[i], NULL, NULL, 0);
+        // don't print trailing space if last element
+        if (i != 0) {
+            lstack_push(s, NULL, NULL, NULL, ' ');
+        }
+    }
+}
+
+
+// function to print a value into a buffer
+void lval_print_buf(lbuf* b, lval* v) {
+    lstack s;
+    lstack_init(&s);
+    lstack_push(&s, v, NULL, NULL, 0);
+
+    while (s.count) {
+        lstep step = lstack_pop(&s);
+
+        // steps without a value are punctuation queued by a list or lambda
+        if (!step.v) {
+            lbuf_putc(b, step.c);
+            continue;
+        }
+
+        v = step.v;
+        switch (v->type) {
+            case LVAL_STR:
+                lval_print_str(b, v);
+                break;
+
+            case LVAL_NUM:
+                lbuf_num(b, v->num);
+                break;
+
+            case LVAL_ERR:
+                lbuf_puts(b, "Error: ");
+                lbuf_puts(b, v->err);
+                break;
+
+            case LVAL_SYM:
+                lbuf_puts(b, v->sym);
+                break;
+
+            case LVAL_SEXPR:
+                lval_expr_print(b, &s, v, '(', ')');
+                break;
+
+            case LVAL_QEXPR:
+                lval_expr_print(b, &s, v, '{', '}');
+                break;
+
+            case LVAL_FUN:
+                if (v->builtin)
+                    lbuf_puts(b, "<builtin>");
+                else {
+                    lbuf_puts(b, "(\\ ");
+                    lstack_push(&s, NULL, NULL, NULL, ')');
+                    lstack_push(&s, v->body, NULL, NULL, 0);
+                    lstack_push(&s, NULL, NULL, NULL, ' ');
+                    lstack_push(&s, v->formals, NULL, NULL, 0);
+                }
+                break;
+
+            case LVAL_FUT:
+                lbuf_puts(b, "<future>");
+                break;
+
+            case LVAL_ACTOR:
+                lbuf_puts(b, "<actor>");
+                break;
+        }
+    }
+
+    lstack_free(&s);
+}
+
+
+// function to write a buffer to this thread's output in a single call
+static void lbuf_flush(lbuf* b) {
+    fwrite(b->data, 1, b->len, LOUT);
+    b->len = 0;
+}
+
+
+// function to print an lval
+void lval_print(lval* v) {
+    lbuf b;
+    lbuf_init(&b);
+    lval_print_buf(&b, v);
+    lbuf_flush(&b);
+    lbuf_free(&b);
+}
+
+
+// function to redirect this thread's printing to f, or back to stdout
+// for NULL, returning the previous stream
+FILE* lval_output(FILE* f) {
+    FILE* old = lval_out;
+    lval_out = f;
+    return old;
+}
+
+
+// function to print an LVAL_STR between double quotes
+void lval_print_str(lbuf* b, lval* v) {
+    lbuf_putc(b, '"');
+    lbuf_escape(b, v->str);
+    lbuf_putc(b, '"');
+}
+
+// function which prints a line of lval
+void lval_println(lval* v) {
+    lbuf b;
+    lbuf_init(&b);
+    lval_print_buf(&b, v);
+    lbuf_putc(&b, '\n');
+    lbuf_flush(&b);
+    lbuf_free(&b);
+}
+
+
+// function to count the characters a number prints as
+static size_t lval_num_len(long x) {
+    size_t n = x < 0 ? 2 : 1;
+    unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    while (u >= 10) {
+        u /= 10;
+        n++;
+    }
+    return n;
+}
+
+
+// function to count the characters a string prints as, escapes included
+static size_t lval_str_len(const char* s) {
+    size_t n = 0;
+    for (; *s; s++) { n += lbuf_escapes[(unsigned char)*s] ? 2 : 1; }
+    return n;
+}
+
+
+// function to count the characters lval_print_buf writes for a value,
+// walking it the same way
+size_t lval_print_len(lval* v) {
+    size_t n = 0;
+    lstack s;
+    lstack_init(&s);
+    lstack_push(&s, v, NULL, NULL, 0);
+
+    while (s.count) {
+        v = lstack_pop(&s).v;
+        switch (v->type) {
+            case LVAL_STR: n += 2 + lval_str_len(v->str); break;
+            case LVAL_NUM: n += lval_num_len(v->num); break;
+            case LVAL_ERR: n += strlen("Error: ") + strlen(v->err); break;
+            case LVAL_SYM: n += strlen(v->sym); break;
+            case LVAL_FUT: n += strlen("<future>"); break;
+            case LVAL_ACTOR: n += strlen("<actor>"); break;
+
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                // brackets and the spaces between cells
+                n += 2 + (v->count ? v->count - 1 : 0);
+                for (int i = 0; i < v->count; i++) {
+                    lstack_push(&s, v->cell[i], NULL, NULL, 0);
+                }
+                break;
+
+            case LVAL_FUN:
+                if (v->builtin) {
+                    n += strlen("<builtin>");
+                } else {
+                    // "(\ ", the space between formals and body, and ")"
+                    n += 5;
+                    lstack_push(&s, v->formals, NULL, NULL, 0);
+                    lstack_push(&s, v->body, NULL, NULL, 0);
+                }
+                break;
+        }
+    }
+
+    lstack_free(&s);
+    return n;
+}
+
+
+// function to serialize a value into a new string, sized up front so it is
+// written without reallocating; the caller frees it
+char* lval_show(lval* v) {
+    size_t n = lval_print_len(v);
+    lbuf b;
+    b.data = malloc(n + 1);
+    b.len = 0;
+    b.cap = n + 1;
+    lval_print_buf(&b, v);
+    b.data[b.len] = '\0';
+    return b.data;
+}
+
+// which of an interpreter's limits stopped an evaluation
+enum { LLIMIT_NONE, LLIMIT_STEPS, LLIMIT_DEPTH, LLIMIT_HEAP, LLIMIT_TIME };
+
+// what a top-level evaluation has used of its interpreter's limits; the
+// threads working for it, running its pmap, pfilter and preduce calls,
+// its futures and the actor turns its messages cause, all charge the
+// same budget, atomically
+struct lbudget {
+    long refs;
+    unsigned long steps;
+    long heap;          // bytes charged with lval_bytes
+    uint64_t deadline;
+    int exceeded;       // the limit that stopped it
+};
+
+// the budget this thread is charging, the calls under way on it, and
+// lval_bytes when the budget was last charged
+static LTHREAD_LOCAL lbudget* lval_budget = NULL;
+static LTHREAD_LOCAL int lval_depth = 0;
+static LTHREAD_LOCAL long lval_charged = 0;
+
+static uint64_t lprof_now(void);
+
+void interp_limit(interp* in, llimits* limits) {
+    in->limits = *limits;
+    in->limited = limits->steps || limits->depth || limits->heap || limits->timeout;
+}
+
+static lbudget* lbudget_ref(lbudget* b) {
+    if (b) { __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED); }
+    return b;
+}
+
+static void lbudget_unref(lbudget* b) {
+    if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) { free(b); }
+}
+
+// function to charge the bytes this thread allocated since it last did to
+// its budget, returning the budget's total
+static long lbudget_charge(lbudget* b) {
+    long n = lval_bytes - lval_charged;
+    lval_charged = lval_bytes;
+    return __atomic_add_fetch(&b->heap, n, __ATOMIC_RELAXED);
+}
+
+// function for a job to charge b, or nothing for NULL, from now on,
+// returning the budget the thread was charging before
+static lbudget* lbudget_enter(lbudget* b) {
+    lbudget* outer = lval_budget;
+    if (outer) { lbudget_charge(outer); }
+    lval_budget = b;
+    lval_charged = lval_bytes;
+    return outer;
+}
+
+// function for a job to go back to charging the budget lbudget_enter returned
+static void lbudget_leave(lbudget* outer) {
+    if (lval_budget) { lbudget_charge(lval_budget); }
+    lval_budget = outer;
+    lval_charged = lval_bytes;
+}
+
+// function to start a budget when a top-level evaluation begins on a thread
+// not charging one, returning it for lbudget_end, or NULL otherwise
+static lbudget* lbudget_begin(interp* in) {
+    if (lval_budget) { return NULL; }
+    lbudget* b = calloc(1, sizeof(lbudget));
+    b->refs = 1;
+    b->deadline = lprof_now() + (uint64_t)in->limits.timeout * 1000000;
+    lbudget_enter(b);
+    return b;
+}
+
+static void lbudget_end(lbudget* b) {
+    if (!b) { return; }
+    lbudget_leave(NULL);
+    lbudget_unref(b);
+}
+
+// function to count an evaluation step and check the limits, returning
+// the limit exceeded if any; the clock is only read every 256 steps
+static int lbudget_step(interp* in, lbudget* b) {
+    llimits* l = &in->limits;
+    int exceeded = __atomic_load_n(&b->exceeded, __ATOMIC_RELAXED);
+    if (exceeded) { return exceeded; }
+
+    unsigned long steps = __atomic_add_fetch(&b->steps, 1, __ATOMIC_RELAXED);
+    long heap = l->heap ? lbudget_charge(b) : 0;
+    if (l->steps && steps > l->steps) {
+        exceeded = LLIMIT_STEPS;
+    } else if (l->heap && heap > 0 && (size_t)heap > l->heap) {
+        exceeded = LLIMIT_HEAP;
+    } else if (l->timeout && (steps & 255) == 0 && lprof_now() > b->deadline) {
+        exceeded = LLIMIT_TIME;
+    }
+    if (exceeded) { __atomic_store_n(&b->exceeded, exceeded, __ATOMIC_RELAXED); }
+    return exceeded;
+}
+
+// function to build the error an exceeded limit stops evaluation with
+static lval* lbudget_err(interp* in, int exceeded) {
+    llimits* l = &in->limits;
+    switch (exceeded) {
+        case LLIMIT_STEPS:
+            return lval_err("evaluation exceeded its limit of %lu steps", l->steps);
+        case LLIMIT_DEPTH:
+            return lval_err("evaluation exceeded its limit of %i nested calls", l->depth);
+        case LLIMIT_HEAP:
+            return lval_err("evaluation exceeded its limit of %lu bytes",
+                (unsigned long)l->heap);
+        default:
+            return lval_err("evaluation exceeded its limit of %lu ms", l->timeout);
+    }
+}
+
+// room left below the deepest evaluation for the builtins and library
+// calls it makes, or a quarter of a smaller stack
+#define LSTACK_RESERVE (256 * 1024)
+
+// the lowest address of this thread's stack evaluation may use, found on
+// first use, or 0 if the bounds are unknown
+static LTHREAD_LOCAL uintptr_t lval_floor = 0;
+static LTHREAD_LOCAL int lval_floor_known = 0;
+
+static uintptr_t lval_stack_floor(void) {
+    if (lval_floor_known) { return lval_floor; }
+    lval_floor_known = 1;
+
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) { return 0; }
+    void* addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        size_t reserve = size / 4 < LSTACK_RESERVE ? size / 4 : LSTACK_RESERVE;
+        lval_floor = (uintptr_t)addr + reserve;
+    }
+    pthread_attr_destroy(&attr);
+    return lval_floor;
+}
+
+// function to evaluate lval
+static lval* lval_eval_node(interp* in, lenv* e, lval* v) {
+    if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+
+    // evaluate S-expressions
+    if (v->type == LVAL_SEXPR) {return lval_eval_sexpr(in, e, v);}
+
+    // all other lval types remain the same
+    return v;
+}
+
+// function to evaluate lval, within the interpreter's limits if it has any
+lval* lval_eval(interp* in, lenv* e, lval* v) {
+    // stop runaway recursion before it overflows the thread's stack, with
+    // or without limits; the stack grows down
+    char here;
+    if ((uintptr_t)&here < lval_stack_floor()) {
+        lval_del(v);
+        return lval_err("evaluation nested too deeply for the stack");
+    }
+
+    if (!in->limited) { return lval_eval_node(in, e, v); }
+
+    lbudget* started = lbudget_begin(in);
+    int exceeded = lbudget_step(in, lval_budget);
+    lval* r;
+    if (exceeded) {
+        lval_del(v);
+        r = lbudget_err(in, exceeded);
+    } else {
+        r = lval_eval_node(in, e, v);
+    }
+    lbudget_end(started);
+    return r;
+}
+
+// function to get ith element of list
+lval* lval_pop(lval* v, int i) {
+    // find the item at i
+    lval* x = v->cell[i];
+
+    // shift memory after i
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count -i -1));
+
+    // decrease item count
+    v->count--;
+    lval_bytes -= sizeof(lval*);
+
+    // reallocate memory used
+    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    
+    return x;
+}
+
+// function to copy a single lval, the cells of a list and the
+// formals and body of a lambda are left for lval_copy to fill in
+lval* lval_copy_node(lval* v) {
+    lval* x = lval_new(v->type);
+
+    switch (v->type) {
+
+        // copy functions and number directly
+        case LVAL_FUN:
+            x->name = v->name;
+            if (v->builtin)
+                x->builtin = v->builtin;
+            else {
+                x->builtin = NULL;
+                x->env = lenv_copy(v->env);
+                x->formals = NULL;
+                x->body = NULL;
+            }
+            break;
+
+        case LVAL_NUM:
+            x->num = v->num;
+            break;
+
+        // futures are shared, not copied
+        case LVAL_FUT:
+            x->fut = lfuture_ref(v->fut);
+            break;
+
+        case LVAL_ACTOR:
+            x->actor = v->actor;
+            break;
+
+        // copy string using malloc and strcpy
+        case LVAL_ERR:
+            x->err = malloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err);
+            lval_bytes += strlen(v->err) + 1;
+            break;
+
+        case LVAL_SYM:
+            x->sym = malloc(strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
+            lval_bytes += strlen(v->sym) + 1;
+            break;
+
+        case LVAL_STR:
+            x->str = malloc(strlen(v->str) + 1);
+            strcpy(x->str, v->str);
+            lval_bytes += strlen(v->str) + 1;
+            break;
+
+        // make room for a copy of each sub-expression
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->count = v->count;
+            x->cell = malloc(sizeof(lval*) * x->count);
+            lval_bytes += sizeof(lval*) * x->count;
+            break;
+    }
+
+    return x;
+}
+
+lval* lval_copy(lval* v) {
+    // copies made for an environment are counted as its lookups and binds
+    int op = lmem_op;
+    if (op != LMEM_LOOKUP && op != LMEM_BIND) { lmem_enter(LMEM_COPY); }
+    lval* root = lval_copy_node(v);
+
+    // each step pairs a value with its copy still to be filled in
+    lstack s;
+    lstack_init(&s);
+    lstack_push(&s, v, root, NULL, 0);
+
+    while (s.count) {
+        lstep step = lstack_pop(&s);
+        v = step.v;
+        lval* x = step.w;
+
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+            for (int i = 0; i < v->count; i++) {
+                x->cell[i] = lval_copy_node(v->cell[i]);
+                lstack_push(&s, v->cell[i], x->cell[i], NULL, 0);
+            }
+        }
+
+        if (v->type == LVAL_FUN && !v->builtin) {
+            x->formals = lval_copy_node(v->formals);
+            x->body = lval_copy_node(v->body);
+            lstack_push(&s, v->formals, x->formals, NULL, 0);
+            lstack_push(&s, v->body, x->body, NULL, 0);
+        }
+    }
+
+    lstack_free(&s);
+    lmem_leave(op);
+    return root;
+}
+
+
+// function that pops and deletes
+lval* lval_take(lval* v, int i) {
+    lval* x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+// function to compare two values, the parts of lists and lambdas are
+// queued on the stack to be compared next rather than recursed into
+int lval_eq_node(lstack* s, lval* x, lval* y) {
+    // different types are always unequal
+    if (x->type != y->type) { return 0; }
+
+    // compare type
+    switch (x->type) {
+        // compare number value
+        case LVAL_NUM: return (x->num == y->num);
+
+        // compare string values
+        case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
+        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+
+        // futures are equal when they are the same spawn
+        case LVAL_FUT: return (x->fut == y->fut);
+        case LVAL_ACTOR: return (x->actor == y->actor);
+
+        // if builtin compare, otherwise compare formals and body
+        case LVAL_FUN:
+            if (x->builtin || y->builtin) {
+                return x->builtin == y->builtin;
+            }
+            lstack_push(s, x->body, y->body, NULL, 0);
+            lstack_push(s, x->formals, y->formals, NULL, 0);
+            return 1;
+
+        // if list compare every individual element
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (x->count != y->count) { return 0; }
+            for (int i = x->count - 1; i >= 0; i--) {
+                lstack_push(s, x->cell[i], y->cell[i], NULL, 0);
+            }
+            return 1;
+    }
+    return 0;
+}
+
+int lval_eq(lval* x, lval* y) {
+    lstack s;
+    lstack_init(&s);
+    lstack_push(&s, x, y, NULL, 0);
+
+    // if any element not equal then whole value not equal
+    int eq = 1;
+    while (eq && s.count) {
+        lstep step = lstack_pop(&s);
+        eq = lval_eq_node(&s, step.v, step.w);
+    }
+
+    lstack_free(&s);
+    return eq;
+}
+
+
+// function which performs calculations on lval
+lval* builtin_op(interp* in, lenv* e, lval* a, char* op) {
+    // ensure all elements of a are numbers
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type != LVAL_NUM) {
+            lval_del(a);
+            return lval_err("cannot operate on non-number");
+        }
+    }
+
+    // pop first element
+    lval* x = lval_pop(a, 0);
+
+    // if no other elements and subtraction perform unary negation
+    if ((strcmp(op, "-") == 0) && a->count == 0) {
+        x->num = -x->num;
+    }
+
+    // while still elements remaining...
+    while (a->count > 0) {
+        // ...pop next element
+        lval* y = lval_pop(a, 0);
+
+        // ...do mathematical operation
+        if (strcmp(op, "+") == 0) {x->num += y->num;}
+        if (strcmp(op, "-") == 0) {x->num -= y->num;}
+        if (strcmp(op, "*") == 0) {x->num *= y->num;}
+        if (strcmp(op, "/") == 0) {
+            if (y->num == 0) {
+                lval_del(x); lval_del(y);
+                x = lval_err("division by zero"); break;
+            }
+            x->num /= y->num;
+        }
+
+        lval_del(y);
+    }
+
+    lval_del(a);
+
+    return x;
+}
+
+
+lval* builtin_add(interp* in, lenv* e, lval* a) {
+    return builtin_op(in, e, a, "+");
+}
+
+
+lval* builtin_sub(interp* in, lenv* e, lval* a) {
+    return builtin_op(in, e, a, "-");
+}
+
+
+lval* builtin_mul(interp* in, lenv* e, lval* a) {
+    return builtin_op(in, e, a, "*");
+}
+
+
+lval* builtin_div(interp* in, lenv* e, lval* a) {
+    return builtin_op(in, e, a, "/");
+}
+
+
+lval* builtin_def(interp* in, lenv* e, lval* a) {
+    return builtin_var(in, e, a, "def");
+}
+
+
+lval* builtin_put(interp* in, lenv* e, lval* a) {
+    return builtin_var(in, e, a, "=");
+}
+
+
+lval* builtin_gt(interp* in, lenv* e, lval* a) {
+    return builtin_ord(in, e, a, ">");
+}
+
+
+lval* builtin_lt(interp* in, lenv* e, lval* a) {
+    return builtin_ord(in, e, a, "<");
+}
+
+
+lval* builtin_ge(interp* in, lenv* e, lval* a) {
+    return builtin_ord(in, e, a, ">=");
+}
+
+lval* builtin_le(interp* in, lenv* e, lval* a) {
+    return builtin_ord(in, e, a, "<=");
+}
+
+
+lval* builtin_cmp(interp* in, lenv* e, lval* a, char* op) {
+    LASSERT_NUM(op, a, 2);
+    int r = 0;
+    if (strcmp(op, "==") == 0) {
+        r = lval_eq(a->cell[0], a->cell[1]);
+    }
+    if (strcmp(op, "!=") == 0) {
+        r = !lval_eq(a->cell[0], a->cell[1]);
+    }
+    lval_del(a);
+    return lval_num(r);
+}
+
+
+lval* builtin_eq(interp* in, lenv* e, lval* a) {
+    return builtin_cmp(in, e, a, "==");
+}
+
+
+lval* builtin_ne(interp* in, lenv* e, lval* a) {
+    return builtin_cmp(in, e, a, "!=");
+}
+
+
+// function to perform conditionals
+lval* builtin_if(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("if", a, 3);
+    LASSERT_TYPE("if", a, 0, LVAL_NUM);
+    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+    // mark both expression as evaluable
+    lval* x;
+    a->cell[1]->type = LVAL_SEXPR;
+    a->cell[2]->type = LVAL_SEXPR;
+
+    if (a->cell[0]->num) {
+        // if condition is true evaluate first expression
+        x = lval_eval(in, e, lval_pop(a, 1));
+    } else {
+        // otherwise evaluate second expression
+        x = lval_eval(in, e, lval_pop(a, 2));
+    }
+
+    // delete argument list and return
+    lval_del(a);
+    return x;
+}
+
+
+// function to define your own variables
+lval* builtin_var(interp* in, lenv* e, lval* a, char* func) {
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    // first argument is symbol list
+    lval* syms = a->cell[0];
+
+    // ensure all elements of first list are symbols
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(
+            a, syms->cell[i]->type == LVAL_SYM,
+            "function '%s' cannot define non-symbol "
+            "(got '%s', expected: '%s')", func,
+            ltype_name(syms->cell[i]->type),
+            ltype_name(LVAL_SYM)
+        );
+    }
+
+    // check correct number of symbols and values
+    LASSERT(
+        a, syms->count == a->count - 1,
+        "function '%s' cannot define incorrect number of values to symbols"
+        " (got %i, expected: %i)", func,
+        syms->count, a->count - 1
+    );
+
+    // assign copies of values to symbols
+    for (int i = 0; i < syms->count; i++) {
+        // a lambda is known by the first name it is defined under
+        lval* v = a->cell[i + 1];
+        if (v->type == LVAL_FUN && !v->builtin && !v->name) {
+            v->name = lname_intern(syms->cell[i]->sym);
+        }
+
+        // if 'def' define globally
+        if (strcmp(func, "def") == 0)
+            lenv_def(e, syms->cell[i], a->cell[i + 1]);
+
+        // if '=' define locally
+        if (strcmp(func, "=") == 0)
+            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+
+// function which defines a lambda function
+lval* builtin_lambda(interp* in, lenv* e, lval* a) {
+    // check two arguments are Q-Expressions
+    LASSERT_NUM("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+    // check first Q-Expression contains only symbols
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+            "cannot define non-symbol (got '%s', expected: '%s')",
+            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+
+    // pop first two arguments and pass them to lval_lambda
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+
+    return lval_lambda(formals, body);
+}
+
+
+// function to parse a file into an S-expression of its expressions,
+// or an error if it does not parse
+lval* lval_read_file(interp* in, char* filename) {
+    mpc_result_t r;
+    if (mpc_parse_contents(filename, in->lispy, &r)) {
+        // read contents
+        lval* expr = lval_read(r.output);
+        mpc_ast_delete(r.output);
+        return expr;
+    } else {
+        // get parse error as string
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        // create new error message
+        lval* err = lval_err("Could not load library %s", err_msg);
+        free(err_msg);
+        return err;
+    }
+}
+
+
+// function to evaluate each expression in turn, printing any errors
+void lval_eval_each(interp* in, lenv* e, lval* expr) {
+    while (expr->count) {
+        lval* x = lval_eval(in, e, lval_pop(expr, 0));
+        // if evaluation leads to error, print it
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+    }
+    lval_del(expr);
+}
+
+
+lval* builtin_load(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    // parse file given by string name
+    lval* expr = lval_read_file(in, a->cell[0]->str);
+    lval_del(a);
+    if (expr->type == LVAL_ERR) { return expr; }
+
+    // evaluate each expression and return empty list
+    lval_eval_each(in, e, expr);
+    return lval_sexpr();
+}
+
+
+lval* builtin_print(interp* in, lenv* e, lval* a) {
+    // print each argument followed by a space, writing the line at once
+    lbuf b;
+    lbuf_init(&b);
+    for (int i = 0; i < a->count; i++) {
+        lval_print_buf(&b, a->cell[i]);
+        lbuf_putc(&b, ' ');
+    }
+    // end with a new line and delete arguments
+    lbuf_putc(&b, '\n');
+    lbuf_flush(&b);
+    lbuf_free(&b);
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+
+lval* builtin_show(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("show", a, 1);
+    // hand the serialized text to the new string rather than copying it
+    lval* v = lval_new(LVAL_STR);
+    v->str = lval_show(a->cell[0]);
+    lval_bytes += strlen(v->str) + 1;
+    lval_del(a);
+    return v;
+}
+
+
+lval* builtin_error(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("error", a, 1);
+    LASSERT_TYPE("error", a, 0, LVAL_STR);
+    // construct error from first argument
+    lval* err = lval_err(a->cell[0]->str);
+    // delete arguments and return
+    lval_del(a);
+    return err;
+}
+
+
+// function which registers the builtin function with an environment
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun(func);
+    v->name = lname_intern(name);
+    lenv_put(e, k, v);
+    lval_del(k);
+    lval_del(v);
+}
+
+
+// every builtin function with the name it is bound to, in the order they
+// are added to an environment
+static const struct {
+    const char* name;
+    lbuiltin func;
+} lbuiltins[] = {
+    // list functions
+    { "len", builtin_len },
+    { "list", builtin_list },
+    { "head", builtin_head },
+    { "tail", builtin_tail },
+    { "eval", builtin_eval },
+    { "join", builtin_join },
+
+    // function definition functions
+    { "def", builtin_def },
+    { "=", builtin_put },
+    { "\\", builtin_lambda },
+
+    // mathematical functions
+    { "+", builtin_add },
+    { "-", builtin_sub },
+    { "*", builtin_mul },
+    { "/", builtin_div },
+
+    // comparison functions
+    { "if", builtin_if },
+    { "==", builtin_eq },
+    { "!=", builtin_ne },
+    { ">", builtin_gt },
+    { "<", builtin_lt },
+    { ">=", builtin_ge },
+    { "<=", builtin_le },
+
+    { "load", builtin_load },
+    { "save-image", builtin_save_image },
+    { "error", builtin_error },
+    { "print", builtin_print },
+    { "show", builtin_show },
+    { "profile-start", builtin_profile_start },
+    { "profile-report", builtin_profile_report },
+    { "mem-stats", builtin_mem_stats },
+
+    // parallel functions
+    { "pmap", builtin_pmap },
+    { "pfilter", builtin_pfilter },
+    { "preduce", builtin_preduce },
+    { "spawn", builtin_spawn },
+    { "await", builtin_await },
+    { "actor", builtin_actor },
+    { "send", builtin_send },
+    { "receive", builtin_receive },
+};
+
+#define LBUILTINS (sizeof(lbuiltins) / sizeof(lbuiltins[0]))
+
+// the interned names of the builtins, looked up once per process
+static const char* lbuiltin_names[LBUILTINS];
+static pthread_once_t lbuiltin_once = PTHREAD_ONCE_INIT;
+
+static void lbuiltin_intern(void) {
+    for (size_t i = 0; i < LBUILTINS; i++) {
+        lbuiltin_names[i] = lname_intern(lbuiltins[i].name);
+    }
+}
+
+// function which registers all builtin functions with an environment
+void lenv_add_builtins(lenv* e) {
+    pthread_once(&lbuiltin_once, lbuiltin_intern);
+
+    // an environment with bindings already may have some of the names
+    if (e->count) {
+        for (size_t i = 0; i < LBUILTINS; i++) {
+            lenv_add_builtin(e, (char*)lbuiltins[i].name, lbuiltins[i].func);
+        }
+        return;
+    }
+
+    // otherwise the names are distinct, so the table is filled in one go
+    // without searching it or copying the values
+    int op = lmem_enter(LMEM_BIND);
+    e->count = LBUILTINS;
+    e->syms = malloc(sizeof(char*) * LBUILTINS);
+    e->vals = malloc(sizeof(lval*) * LBUILTINS);
+    for (size_t i = 0; i < LBUILTINS; i++) {
+        size_t n = strlen(lbuiltins[i].name) + 1;
+        e->syms[i] = memcpy(malloc(n), lbuiltins[i].name, n);
+        e->vals[i] = lval_fun(lbuiltins[i].func);
+        e->vals[i]->name = lbuiltin_names[i];
+    }
+    lmem_leave(op);
+}
+
+
+// function that returns the number of elements in a Q-expression
+lval* builtin_len(interp* in, lenv* e, lval* a) {
+    // check error condition
+    LASSERT(
+        a,
+        a->count == 1,
+        "function 'len' was passed too many arguments "
+        "(got %i, expected: %i)",
+        a->count, 1
+    );
+
+    LASSERT(
+        a,
+        a->cell[0]->type == LVAL_QEXPR,
+        "function 'len' was passed incorrect type "
+        "(got '%s', expected '%s')",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR)
+    );
+
+    long n = a->cell[0]->count;
+    lval_del(a);
+    return lval_num(n);
+}
+
+lval* builtin_head(interp* in, lenv* e, lval* a) {
+    // check error condition
+    LASSERT(
+        a,
+        a->count == 1,
+        "function 'head' was passed too many arguments "
+        "(got %i, expect %i)", a->count, 1
+    );
+
+    LASSERT(
+        a,
+        a->cell[0]->type == LVAL_QEXPR,
+        "function 'head' was passed incorrect type "
+        "(got '%s', expected '%s')",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR)
+
+    );
+
+    LASSERT(
+        a,
+        a->cell[0]->count != 0,
+        "function 'head' passed {}"
+    );
+
+    // otherwise take first arg
+    lval* v = lval_take(a, 0);
+
+    // delete all elements that are not head and return
+    while (v->count > 1)
+        lval_del(lval_pop(v, 1));
+
+    return v;
+}
+
+lval* builtin_tail(interp* in, lenv* e, lval* a) {
+    // check error condition
+    LASSERT(
+        a,
+        a->count == 1,
+        "function 'head' was passed too many arguments "
+        "(got %i, expect %i)", a->count, 1
+
+    );
+
+    LASSERT(
+        a,
+        a->cell[0]->type == LVAL_QEXPR,
+        "function 'tail' was passed incorrect type "
+        "(got '%s', expected '%s')",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR)
+
+    );
+
+    LASSERT(
+        a,
+        a->cell[0]->count != 0,
+        "function 'tail' passed {}"
+    );
+
+    lval* v = lval_take(a, 0);
+    lval_del(lval_pop(v, 0));
+
+    return v;
+}
+
+lval* builtin_list(interp* in, lenv* e, lval* a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+lval* builtin_eval(interp* in, lenv* e, lval* a) {
+    LASSERT(
+        a,
+        a->count == 1,
+        "function 'eval' was passed too many arguments "
+        "(got %i, expect %i)", a->count, 1
+    );
+
+    LASSERT(
+        a,
+        a->cell[0]->type == LVAL_QEXPR,
+        "function 'eval' was passed incorrect type "
+        "(got '%s', expected '%s')",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR)
+
+    );
+
+    lval* x = lval_take(a, 0);
+    x->type = LVAL_SEXPR;
+
+    return lval_eval(in, e, x);
+}
+
+lval* builtin_join(interp* in, lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(
+            a,
+            a->cell[i]->type == LVAL_QEXPR,
+            "function 'join' was passed incorrect type "
+            "(got '%s', expected '%s')",
+            ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR)
+
+        );
+    }
+
+    lval* x = lval_pop(a, 0);
+
+    while (a->count)
+        x = lval_join(x, lval_pop(a, 0));
+
+    lval_del(a);
+
+    return x;
+}
+
+
+// function to get the interpreter's worker pool, starting it on first use
+static lpool* interp_pool(interp* in) {
+    pthread_mutex_lock(&in->lock);
+    if (!in->pool) { in->pool = lpool_new(in->jobs); }
+    pthread_mutex_unlock(&in->lock);
+    return in->pool;
+}
+
+
+// function to get the interpreter's background executor, starting it on first use
+static lexec* interp_exec(interp* in) {
+    pthread_mutex_lock(&in->lock);
+    if (!in->exec) { in->exec = lexec_new(in->jobs); }
+    pthread_mutex_unlock(&in->lock);
+    return in->exec;
+}
+
+
+// state shared by the workers of one parallel call; every worker evaluates
+// in its own flattened copy of the calling environment and only writes its
+// own result slots, so no lval is shared between threads
+typedef struct {
+    interp* in;
+    lscope* scope;
+    lbudget* budget;
+    lenv* e;
+    lval* f;
+    lval** items;
+    int count;
+    int chunk;
+    lval** results;
+    lenv** envs;
+} lpar;
+
+
+// function to call a copy of the function with args on worker w
+static lval* lpar_call(lpar* p, int w, lval* args) {
+    if (!p->envs[w]) { p->envs[w] = lenv_flatten(p->e); }
+    lscope* outer = lval_scope;
+    lval_scope = p->scope;
+    lbudget* outer_budget = lbudget_enter(p->budget);
+    lval* f = lval_copy(p->f);
+    lval* x = lval_call(p->in, p->envs[w], f, args);
+    lval_del(f);
+    lbudget_leave(outer_budget);
+    lval_scope = outer;
+    return x;
+}
+
+
+// task applying the function to item i
+static void lpar_map(void* ctx, int i, int w) {
+    lpar* p = ctx;
+    p->results[i] = lpar_call(p, w, lval_add(lval_sexpr(), lval_copy(p->items[i])));
+}
+
+
+// task folding the items of chunk i from the left
+static void lpar_fold(void* ctx, int i, int w) {
+    lpar* p = ctx;
+    int lo = i * p->chunk;
+    int hi = lo + p->chunk < p->count ? lo + p->chunk : p->count;
+    lval* x = lval_copy(p->items[lo]);
+    for (int j = lo + 1; j < hi && x->type != LVAL_ERR; j++) {
+        x = lpar_call(p, w, lval_add(lval_add(lval_sexpr(), x), lval_copy(p->items[j])));
+    }
+    p->results[i] = x;
+}
+
+
+// function to run n tasks on the interpreter's worker pool, creating
+// the pool on first use, and return their results
+static lval** lpar_run(interp* in, lenv* e, lval* f, lval* l, int n, int chunk, ltask task) {
+    int workers = lpool_size(interp_pool(in));
+    lpar p = { in, lval_scope, lval_budget, e, f, l->cell, l->count, chunk,
+        malloc(sizeof(lval*) * (n ? n : 1)), calloc(workers, sizeof(lenv*)) };
+
+    lpool_run(in->pool, n, task, &p);
+
+    for (int w = 0; w < workers; w++) {
+        if (p.envs[w]) { lenv_del(p.envs[w]); }
+    }
+    free(p.envs);
+    return p.results;
+}
+
+
+// function to take the first error out of n results, deleting the rest,
+// or return NULL when there is none
+static lval* lpar_error(lval** results, int n) {
+    lval* err = NULL;
+    for (int i = 0; i < n && !err; i++) {
+        if (results[i]->type == LVAL_ERR) {
+            err = results[i];
+            results[i] = NULL;
+        }
+    }
+    if (err) {
+        for (int i = 0; i < n; i++) {
+            if (results[i]) { lval_del(results[i]); }
+        }
+        free(results);
+    }
+    return err;
+}
+
+
+// function to apply a function to every element of a Q-expression in parallel
+lval* builtin_pmap(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("pmap", a, 2);
+    LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+    LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+    lval* l = a->cell[1];
+    lval** results = lpar_run(in, e, a->cell[0], l, l->count, 1, lpar_map);
+
+    lval* err = lpar_error(results, l->count);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    lval* x = lval_qexpr();
+    for (int i = 0; i < l->count; i++) { x = lval_add(x, results[i]); }
+    free(results);
+    lval_del(a);
+    return x;
+}
+
+
+// function to keep the elements of a Q-expression for which a function
+// returns a non-zero number, testing them in parallel
+lval* builtin_pfilter(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("pfilter", a, 2);
+    LASSERT_TYPE("pfilter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("pfilter", a, 1, LVAL_QEXPR);
+
+    lval* l = a->cell[1];
+    lval** results = lpar_run(in, e, a->cell[0], l, l->count, 1, lpar_map);
+
+    lval* err = lpar_error(results, l->count);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    lval* x = lval_qexpr();
+    for (int i = 0; i < l->count; i++) {
+        if (results[i]->type != LVAL_NUM && !err) {
+            err = lval_err("function 'pfilter' expects the predicate to return '%s' "
+                "(got '%s')", ltype_name(LVAL_NUM), ltype_name(results[i]->type));
+        }
+        if (!err && results[i]->num) { x = lval_add(x, lval_copy(l->cell[i])); }
+        lval_del(results[i]);
+    }
+    free(results);
+    lval_del(a);
+
+    if (err) {
+        lval_del(x);
+        return err;
+    }
+    return x;
+}
+
+
+// function to fold a Q-expression with an associative function, reducing
+// chunks of it in parallel and then combining the chunks from the left
+lval* builtin_preduce(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("preduce", a, 3);
+    LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+    LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+    lval* l = a->cell[2];
+    // a few chunks per worker so stealing can even out uneven work
+    int tasks = lpool_size(interp_pool(in)) * 4;
+    int chunk = l->count / tasks + (l->count % tasks != 0);
+    int n = chunk ? (l->count + chunk - 1) / chunk : 0;
+    lval** results = lpar_run(in, e, a->cell[0], l, n, chunk, lpar_fold);
+
+    lval* err = lpar_error(results, n);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    // combine the initial value with each chunk in order
+    lval* f = lval_pop(a, 0);
+    lval* x = lval_pop(a, 0);
+    for (int i = 0; i < n; i++) {
+        if (x->type == LVAL_ERR) {
+            lval_del(results[i]);
+            continue;
+        }
+        lval* g = lval_copy(f);
+        x = lval_call(in, e, g, lval_add(lval_add(lval_sexpr(), x), results[i]));
+        lval_del(g);
+    }
+
+    free(results);
+    lval_del(f);
+    lval_del(a);
+    return x;
+}
+
+
+// function to evaluate a future unless another thread already started it
+static void lfuture_run(lfuture* f) {
+    pthread_mutex_lock(&f->lock);
+    int pending = f->state == LFUT_PENDING;
+    if (pending) { f->state = LFUT_RUNNING; }
+    pthread_mutex_unlock(&f->lock);
+    if (!pending) { return; }
+
+    lscope* outer = lval_scope;
+    lval_scope = f->scope;
+    lbudget* outer_budget = lbudget_enter(f->budget);
+    lval* x = lval_eval(f->in, f->env, f->expr);
+    lenv_del(f->env);
+    lbudget_leave(outer_budget);
+    lval_scope = outer;
+
+    pthread_mutex_lock(&f->lock);
+    f->env = NULL;
+    f->expr = NULL;
+    f->result = x;
+    f->state = LFUT_DONE;
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->lock);
+}
+
+
+static void lfuture_job(void* ctx) {
+    lscope* scope = ((lfuture*)ctx)->scope;
+    lfuture_run(ctx);
+    lfuture_unref(ctx);
+    lscope_release(scope);
+}
+
+
+// function to evaluate a Q-expression in the background, returning a future
+lval* builtin_spawn(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("spawn", a, 1);
+    LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+
+    lfuture* f = malloc(sizeof(lfuture));
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->done, NULL);
+    f->refs = 2;
+    f->state = LFUT_PENDING;
+    f->in = in;
+    // the task gets its own frame, so later changes to e can't race with it
+    f->env = lenv_flatten(e);
+    f->scope = lval_scope;
+    f->budget = lbudget_ref(lval_budget);
+    f->expr = lval_take(a, 0);
+    f->expr->type = LVAL_SEXPR;
+    f->result = NULL;
+
+    lscope_hold(f->scope);
+    lexec_submit(interp_exec(in), lfuture_job, f);
+    return lval_fut(f);
+}
+
+
+// function to wait for a future and return a copy of its value
+lval* builtin_await(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("await", a, 1);
+    LASSERT_TYPE("await", a, 0, LVAL_FUT);
+
+    lfuture* f = a->cell[0]->fut;
+
+    // run it here if no thread has picked it up yet, so a spawned task
+    // never waits on a job queued behind it
+    lfuture_run(f);
+
+    pthread_mutex_lock(&f->lock);
+    while (f->state != LFUT_DONE) {
+        pthread_cond_wait(&f->done, &f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    // the result no longer changes, so it can be copied without the lock
+    lval* x = lval_copy(f->result);
+    lval_del(a);
+    return x;
+}
+
+
+// messages handled per turn before an actor yields its worker
+#define LACTOR_BATCH 64
+
+// a message in an actor's mailbox
+typedef struct {
+    lnode node;
+    lval* v;
+    lbudget* budget;    // the budget of the evaluation that sent it, if any
+} lmsg;
+
+struct lactor {
+    interp* in;
+    lscope* scope;  // the scoped evaluation that created it, if any
+    lenv* env;
+    lval* handler;  // called with each message, NULL for the main script
+    lmpsc mailbox;
+    long pending;   // messages sent and not yet handled, updated atomically
+    lactor* next;
+
+    // the main script sleeps here while its mailbox is empty
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+// the actor whose handler this thread is running, if any
+static LTHREAD_LOCAL lactor* lactor_current = NULL;
+
+
+// function to create an actor running handler in env, and register it
+static lactor* lactor_new(interp* in, lenv* env, lval* handler) {
+    lactor* a = malloc(sizeof(lactor));
+    a->in = in;
+    a->scope = lval_scope;
+    a->env = env;
+    a->handler = handler;
+    lmpsc_init(&a->mailbox);
+    a->pending = 0;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->ready, NULL);
+
+    // let the actor refer to itself
+    lval* k = lval_sym("self");
+    lval* v = lval_actor(a);
+    lenv_put(env, k, v);
+    lval_del(k);
+    lval_del(v);
+
+    pthread_mutex_lock(&in->lock);
+    a->next = in->actors;
+    in->actors = a;
+    pthread_mutex_unlock(&in->lock);
+    return a;
+}
+
+
+// function to delete an actor with any messages it never handled
+static void lactor_del(lactor* a) {
+    lnode* n;
+    while ((n = lmpsc_pop(&a->mailbox))) {
+        lval_del(((lmsg*)n)->v);
+        lbudget_unref(((lmsg*)n)->budget);
+        free(n);
+    }
+    if (a->handler) {
+        lenv_del(a->env);
+        lval_del(a->handler);
+    }
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->ready);
+    free(a);
+}
+
+
+// function to take the next message, which the caller knows was sent,
+// with a reference to the budget it is charged to if budget is not NULL
+static lval* lactor_take(lactor* a, lbudget** budget) {
+    lmsg* m = (lmsg*)lmpsc_pop_wait(&a->mailbox);
+    lval* v = m->v;
+    if (budget) { *budget = m->budget; }
+    else { lbudget_unref(m->budget); }
+    free(m);
+    return v;
+}
+
+
+// job handling a batch of an actor's messages on an executor thread;
+// an actor is scheduled only while it has pending messages, and never
+// on two threads at once
+static void lactor_job(void* ctx) {
+    lactor* a = ctx;
+    lscope* scope = a->scope;
+    lactor* outer = lactor_current;
+    lscope* outer_scope = lval_scope;
+    lactor_current = a;
+    lval_scope = scope;
+
+    for (int k = 0; k < LACTOR_BATCH; k++) {
+        // a message is handled within the limits of the evaluation that sent it
+        lbudget* budget;
+        lval* m = lactor_take(a, &budget);
+        lbudget* outer_budget = lbudget_enter(budget);
+        lval* f = lval_copy(a->handler);
+        lval* x = lval_call(a->in, a->env, f, lval_add(lval_sexpr(), m));
+        lval_del(f);
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+        lbudget_leave(outer_budget);
+        lbudget_unref(budget);
+
+        if (__atomic_sub_fetch(&a->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            lactor_current = outer;
+            lval_scope = outer_scope;
+            lscope_release(scope);
+            return;
+        }
+    }
+
+    // more is waiting, go to the back of the queue so other actors get a turn
+    lactor_current = outer;
+    lval_scope = outer_scope;
+    lexec_submit(interp_exec(a->in), lactor_job, a);
+}
+
+
+// function to create an actor that calls a function with every message it
+// is sent, in its own copy of the calling environment
+lval* builtin_actor(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("actor", a, 1);
+    LASSERT_TYPE("actor", a, 0, LVAL_FUN);
+
+    lactor* x = lactor_new(in, lenv_flatten(e), lval_pop(a, 0));
+    lval_del(a);
+    return lval_actor(x);
+}
+
+
+// function to copy a value into an actor's mailbox
+lval* builtin_send(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("send", a, 2);
+    LASSERT_TYPE("send", a, 0, LVAL_ACTOR);
+
+    lactor* to = a->cell[0]->actor;
+    lmsg* m = malloc(sizeof(lmsg));
+    m->v = lval_pop(a, 1);
+    m->budget = lbudget_ref(lval_budget);
+    lval_del(a);
+
+    lmpsc_push(&to->mailbox, &m->node);
+    long pending = __atomic_fetch_add(&to->pending, 1, __ATOMIC_ACQ_REL);
+
+    if (!to->handler) {
+        // wake the main script
+        pthread_mutex_lock(&to->lock);
+        pthread_cond_broadcast(&to->ready);
+        pthread_mutex_unlock(&to->lock);
+    } else if (pending == 0) {
+        // the first pending message schedules the actor
+        lscope_hold(to->scope);
+        lexec_submit(interp_exec(in), lactor_job, to);
+    }
+
+    return lval_sexpr();
+}
+
+
+// function for the main script to wait for a number of messages sent to
+// it, returning them as a Q-expression
+lval* builtin_receive(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("receive", a, 1);
+    LASSERT_TYPE("receive", a, 0, LVAL_NUM);
+    LASSERT(a, !lactor_current && pthread_equal(pthread_self(), in->thread),
+        "function 'receive' can only be used by the main script, "
+        "actors are passed their messages");
+
+    long n = a->cell[0]->num;
+    lval_del(a);
+
+    lactor* r = in->root;
+    lval* x = lval_qexpr();
+    for (long i = 0; i < n; i++) {
+        pthread_mutex_lock(&r->lock);
+        while (__atomic_load_n(&r->pending, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&r->ready, &r->lock);
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        x = lval_add(x, lactor_take(r, NULL));
+        __atomic_sub_fetch(&r->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    return x;
+}
+
+
+// fonction to perform number comparisons
+lval* builtin_ord(interp* in, lenv* e, lval* a, char* op) {
+    LASSERT_NUM(op, a, 2);
+    LASSERT_TYPE(op, a, 0, LVAL_NUM);
+    LASSERT_TYPE(op, a, 1, LVAL_NUM);
+
+    int r = 0;
+    if (strcmp(op, ">") == 0) {
+        r = (a->cell[0]->num > a->cell[1]->num);
+    }
+    if (strcmp(op, "<") == 0) {
+        r = (a->cell[0]->num < a->cell[1]->num);
+    }
+    if (strcmp(op, ">=") == 0) {
+        r = (a->cell[0]->num >= a->cell[1]->num);
+    }
+    if (strcmp(op, "<=") == 0) {
+        r = (a->cell[0]->num <= a->cell[1]->num);
+    }
+    lval_del(a);
+    return lval_num(r);
+}
+
+
+lval* lval_join(lval* x, lval* y) {
+    // for each cell in y add it to x
+    while (y->count)
+        x = lval_add(x, lval_pop(y, 0));
+
+    // delete the empty y and return x
+    lval_del(y);
+    return x;
+}
+
+// function to evaluate S-expressions (error checking, etc)
+lval* lval_eval_sexpr(interp* in, lenv* e, lval* v) {
+    // evaluate children
+    for (int i = 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(in, e, v->cell[i]);
+    }
+
+    // error checking
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type == LVAL_ERR) {return lval_take(v, i);}
+    }
+
+    // empty expression
+    if (v->count == 0) {return v;}
+
+    // single expression
+    if (v->count == 1) {return lval_take(v, 0);}
+
+    // ensure first element is a function after evaluation
+    lval* f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN) {
+        lval* err = lval_err(
+            "S-Expression starts with incorrect type "
+            "(got '%s', expected: '%s')",
+            ltype_name(f->type), ltype_name(LVAL_FUN));
+        lval_del(f);
+        lval_del(v);
+        return err;
+    }
+
+    // call function
+    lval* result = lval_call(in, e, f, v);
+    lval_del(f);
+
+    return result;
+}
+
+
+// function names are interned for the life of the process, so functions
+// carry them around without copying
+static pthread_mutex_t lname_lock = PTHREAD_MUTEX_INITIALIZER;
+static char** lname_table = NULL;
+static size_t lname_cap = 0;
+static size_t lname_count = 0;
+
+static size_t lname_hash(const char* s) {
+    size_t h = 2166136261u;
+    for (; *s; s++) { h = (h ^ (unsigned char)*s) * 16777619u; }
+    return h;
+}
+
+// function to look up the single copy of a name, adding it if new
+const char* lname_intern(const char* s) {
+    pthread_mutex_lock(&lname_lock);
+
+    // keep the table at most half full
+    if ((lname_count + 1) * 2 > lname_cap) {
+        size_t cap = lname_cap ? lname_cap * 2 : 64;
+        char** table = calloc(cap, sizeof(char*));
+        for (size_t i = 0; i < lname_cap; i++) {
+            if (!lname_table[i]) { continue; }
+            size_t j = lname_hash(lname_table[i]) & (cap - 1);
+            while (table[j]) { j = (j + 1) & (cap - 1); }
+            table[j] = lname_table[i];
+        }
+        free(lname_table);
+        lname_table = table;
+        lname_cap = cap;
+    }
+
+    size_t i = lname_hash(s) & (lname_cap - 1);
+    while (lname_table[i] && strcmp(lname_table[i], s) != 0) {
+        i = (i + 1) & (lname_cap - 1);
+    }
+    if (!lname_table[i]) {
+        lname_table[i] = malloc(strlen(s) + 1);
+        strcpy(lname_table[i], s);
+        lname_count++;
+    }
+    const char* name = lname_table[i];
+
+    pthread_mutex_unlock(&lname_lock);
+    return name;
+}
+
+
+// one function's counters; times are in nanoseconds, and allocations and
+// self time leave out the functions it called
+typedef struct {
+    const char* name;
+    unsigned long calls;
+    unsigned long allocs;
+    uint64_t total;
+    uint64_t self;
+    int active;     // calls of it under way on this thread
+} lpentry;
+
+// the counters of one thread, keyed by interned name, so recording a call
+// takes no lock
+typedef struct lptab {
+    lpentry* entries;
+    int cap;
+    int count;
+    pthread_t thread;   // the thread writing it
+    struct lptab* next;
+} lptab;
+
+struct lprof {
+    unsigned long id;
+    pthread_mutex_t lock;   // guards the list of tables
+    lptab* tabs;
+};
+
+// profiles are told apart by id, as a new one may reuse a freed address
+static unsigned long lprof_ids = 0;
+
+// this thread's table in the profile with id lprof_tab_id, and the time and
+// allocations of the calls made by the function being profiled
+static LTHREAD_LOCAL lptab* lprof_tab = NULL;
+static LTHREAD_LOCAL unsigned long lprof_tab_id = 0;
+static LTHREAD_LOCAL uint64_t lprof_child_time = 0;
+static LTHREAD_LOCAL unsigned long lprof_child_allocs = 0;
+
+static uint64_t lprof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// function to find a name's counters in a thread's table, adding them if new
+static lpentry* lptab_get(lptab* t, const char* name) {
+    if ((t->count + 1) * 2 > t->cap) {
+        int cap = t->cap ? t->cap * 2 : 64;
+        lpentry* entries = calloc(cap, sizeof(lpentry));
+        for (int i = 0; i < t->cap; i++) {
+            if (!t->entries[i].name) { continue; }
+            size_t j = ((uintptr_t)t->entries[i].name >> 3) & (cap - 1);
+            while (entries[j].name) { j = (j + 1) & (cap - 1); }
+            entries[j] = t->entries[i];
+        }
+        free(t->entries);
+        t->entries = entries;
+        t->cap = cap;
+    }
+
+    // names are interned, so compare pointers
+    size_t i = ((uintptr_t)name >> 3) & (t->cap - 1);
+    while (t->entries[i].name && t->entries[i].name != name) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    if (!t->entries[i].name) {
+        t->entries[i].name = name;
+        t->count++;
+    }
+    return &t->entries[i];
+}
+
+// function to get this thread's table in a profile; only the last one
+// used is cached, so a thread switching between interpreters looks its
+// table up again rather than adding another
+static lptab* lprof_thread(lprof* p) {
+    if (lprof_tab_id != p->id) {
+        pthread_t self = pthread_self();
+        pthread_mutex_lock(&p->lock);
+        lptab* t = p->tabs;
+        while (t && !pthread_equal(t->thread, self)) { t = t->next; }
+        if (!t) {
+            t = calloc(1, sizeof(lptab));
+            t->thread = self;
+            t->next = p->tabs;
+            p->tabs = t;
+        }
+        pthread_mutex_unlock(&p->lock);
+        lprof_tab = t;
+        lprof_tab_id = p->id;
+    }
+    return lprof_tab;
+}
+
+// function to get the name a function is profiled under
+static const char* lval_fun_name(lval* f) {
+    return f->name ? f->name : (f->builtin ? "<builtin>" : "<lambda>");
+}
+
+// function to call a function, adding the call to its counters
+static lval* lprof_call(lprof* p, interp* in, lenv* e, lval* f, lval* a) {
+    lptab* t = lprof_thread(p);
+    const char* name = lval_fun_name(f);
+    lpentry* x = lptab_get(t, name);
+    x->calls++;
+    // time spent in a recursive call is already part of the outer one
+    int outer = x->active++ == 0;
+
+    uint64_t child_time = lprof_child_time;
+    unsigned long child_allocs = lprof_child_allocs;
+    lprof_child_time = 0;
+    lprof_child_allocs = 0;
+    unsigned long allocs = lval_allocs;
+    uint64_t start = lprof_now();
+
+    lval* r = lval_apply(in, e, f, a);
+
+    uint64_t elapsed = lprof_now() - start;
+    allocs = lval_allocs - allocs;
+
+    // the table may have grown during the call
+    x = lptab_get(t, name);
+    x->active--;
+    if (outer) { x->total += elapsed; }
+    x->self += elapsed - lprof_child_time;
+    x->allocs += allocs - lprof_child_allocs;
+
+    lprof_child_time = child_time + elapsed;
+    lprof_child_allocs = child_allocs + allocs;
+    return r;
+}
+
+void interp_profile_start(interp* in) {
+    pthread_mutex_lock(&in->lock);
+    lprof* p = in->prof;
+    if (!p) {
+        p = malloc(sizeof(lprof));
+        p->id = __atomic_add_fetch(&lprof_ids, 1, __ATOMIC_RELAXED);
+        pthread_mutex_init(&p->lock, NULL);
+        p->tabs = NULL;
+        __atomic_store_n(&in->prof, p, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    // clear the counters, keeping track of the calls under way
+    pthread_mutex_lock(&p->lock);
+    for (lptab* t = p->tabs; t; t = t->next) {
+        for (int i = 0; i < t->cap; i++) {
+            lpentry* x = &t->entries[i];
+            x->calls = x->allocs = 0;
+            x->total = x->self = 0;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void lprof_del(lprof* p) {
+    while (p->tabs) {
+        lptab* t = p->tabs;
+        p->tabs = t->next;
+        free(t->entries);
+        free(t);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+static int lpentry_by_name(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const lpentry*)a)->name;
+    uintptr_t y = (uintptr_t)((const lpentry*)b)->name;
+    return (x > y) - (x < y);
+}
+
+static int lpentry_by_self(const void* a, const void* b) {
+    uint64_t x = ((const lpentry*)a)->self;
+    uint64_t y = ((const lpentry*)b)->self;
+    return (x < y) - (x > y);
+}
+
+void interp_profile_report(interp* in, FILE* f, int limit) {
+    lprof* p = __atomic_load_n(&in->prof, __ATOMIC_ACQUIRE);
+    if (!p) {
+        fputs("no profile recorded\n", f);
+        return;
+    }
+
+    // gather every thread's counters, then add up those of the same name
+    pthread_mutex_lock(&p->lock);
+    int count = 0;
+    for (lptab* t = p->tabs; t; t = t->next) { count += t->count; }
+    lpentry* all = malloc(sizeof(lpentry) * (count ? count : 1));
+    int n = 0;
+    for (lptab* t = p->tabs; t; t = t->next) {
+        for (int i = 0; i < t->cap; i++) {
+            if (t->entries[i].name && t->entries[i].calls) { all[n++] = t->entries[i]; }
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    qsort(all, n, sizeof(lpentry), lpentry_by_name);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (m && all[m - 1].name == all[i].name) {
+            all[m - 1].calls += all[i].calls;
+            all[m - 1].allocs += all[i].allocs;
+            all[m - 1].total += all[i].total;
+            all[m - 1].self += all[i].self;
+        } else {
+            all[m++] = all[i];
+        }
+    }
+    qsort(all, m, sizeof(lpentry), lpentry_by_self);
+    if (limit > 0 && limit < m) { m = limit; }
+
+    fprintf(f, "%10s %12s %12s %10s  %s\n", "calls", "total ms", "self ms", "allocs", "function");
+    for (int i = 0; i < m; i++) {
+        fprintf(f, "%10lu %12.3f %12.3f %10lu  %s\n", all[i].calls,
+            all[i].total / 1e6, all[i].self / 1e6, all[i].allocs, all[i].name);
+    }
+    free(all);
+}
+
+
+lval* builtin_profile_start(interp* in, lenv* e, lval* a) {
+    // arguments are ignored, they only make this a call
+    interp_profile_start(in);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+
+lval* builtin_profile_report(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("profile-report", a, 1);
+    LASSERT_TYPE("profile-report", a, 0, LVAL_NUM);
+    int limit = a->cell[0]->num;
+    lval_del(a);
+    interp_profile_report(in, LOUT, limit);
+    return lval_sexpr();
+}
+
+
+// function to add up the counters of every thread
+static void lmem_sum(unsigned long allocs[LMEM_OPS][LVAL_TYPES], unsigned long* frees) {
+    memset(allocs, 0, sizeof(unsigned long) * LMEM_OPS * LVAL_TYPES);
+    *frees = 0;
+    pthread_mutex_lock(&lmem_lock);
+    for (lmemtab* t = lmem_tabs; t; t = t->next) {
+        for (int op = 0; op < LMEM_OPS; op++) {
+            for (int type = 0; type < LVAL_TYPES; type++) {
+                allocs[op][type] += __atomic_load_n(&t->allocs[op][type], __ATOMIC_RELAXED);
+            }
+        }
+        *frees += __atomic_load_n(&t->frees, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&lmem_lock);
+}
+
+void lispy_mem_start(void) {
+    __atomic_store_n(&lmem_on, 1, __ATOMIC_RELAXED);
+}
+
+int lispy_mem_counting(void) {
+    return __atomic_load_n(&lmem_on, __ATOMIC_RELAXED);
+}
+
+unsigned long lispy_mem_allocated(void) {
+    unsigned long allocs[LMEM_OPS][LVAL_TYPES];
+    unsigned long frees;
+    lmem_sum(allocs, &frees);
+
+    unsigned long total = 0;
+    for (int op = 0; op < LMEM_OPS; op++) {
+        for (int type = 0; type < LVAL_TYPES; type++) { total += allocs[op][type]; }
+    }
+    return total;
+}
+
+void lispy_mem_report(FILE* f) {
+    unsigned long allocs[LMEM_OPS][LVAL_TYPES];
+    unsigned long frees;
+    lmem_sum(allocs, &frees);
+
+    fprintf(f, "%-14s", "lvals");
+    for (int op = 0; op < LMEM_OPS; op++) { fprintf(f, " %10s", lmem_op_names[op]); }
+    fprintf(f, " %10s\n", "total");
+
+    unsigned long column[LMEM_OPS] = {0};
+    unsigned long total = 0;
+    for (int type = 0; type < LVAL_TYPES; type++) {
+        unsigned long row = 0;
+        fprintf(f, "%-14s", ltype_name(type));
+        for (int op = 0; op < LMEM_OPS; op++) {
+            fprintf(f, " %10lu", allocs[op][type]);
+            row += allocs[op][type];
+            column[op] += allocs[op][type];
+        }
+        fprintf(f, " %10lu\n", row);
+        total += row;
+    }
+
+    fprintf(f, "%-14s", "total");
+    for (int op = 0; op < LMEM_OPS; op++) { fprintf(f, " %10lu", column[op]); }
+    fprintf(f, " %10lu\n", total);
+
+    // lvals allocated before counting started may have been freed since
+    unsigned long live = total > frees ? total - frees : 0;
+    fprintf(f, "%lu freed, %lu live (%lu bytes of lval headers)\n",
+        frees, live, live * (unsigned long)sizeof(lval));
+}
+
+
+lval* builtin_mem_stats(interp* in, lenv* e, lval* a) {
+    // arguments are ignored, they only make this a call
+    lval_del(a);
+    if (!lispy_mem_counting()) {
+        return lval_err("function 'mem-stats' needs allocations to be counted, "
+            "run with --mem-stats");
+    }
+    lispy_mem_report(LOUT);
+    return lval_sexpr();
+}
+
+
+// The sampling profiler. While it runs, every call pushes the function's
+// name on a per-thread stack, and a SIGPROF timer interrupts whichever
+// thread is using the CPU, whose handler copies that stack into a lock-free
+// ring. A background thread drains the ring into counts per distinct stack,
+// written out in the folded format flame graph tools read. Thread-local
+// storage is not safe to read in a signal handler in a shared library, so
+// each thread keeps its stack in a slot of a global table, which the
+// handler finds by thread id.
+
+// frames kept per stack, deeper calls are left out of the sample
+#define LSAMPLE_DEPTH 64
+// samples the ring holds between drains, a power of two
+#define LSAMPLE_RING 1024
+// threads whose stacks can be sampled at once
+#define LSAMPLE_THREADS 256
+
+// the calls under way on a thread, outermost first
+typedef struct {
+    long tid;       // the thread's id, 0 while the slot is free
+    int depth;
+    const char* frames[LSAMPLE_DEPTH];
+} lsample_stack;
+
+static lsample_stack lsample_stacks[LSAMPLE_THREADS];
+
+// this thread's slot, NULL until its first sampled call, or the table was full
+static LTHREAD_LOCAL lsample_stack* lsample_self = NULL;
+static LTHREAD_LOCAL int lsample_full = 0;
+
+// frees a thread's slot when it exits
+static pthread_key_t lsample_key;
+static pthread_once_t lsample_key_once = PTHREAD_ONCE_INIT;
+
+static void lsample_release(void* slot) {
+    lsample_stack* x = slot;
+    x->depth = 0;
+    __atomic_store_n(&x->tid, 0, __ATOMIC_RELEASE);
+}
+
+static void lsample_key_init(void) {
+    pthread_key_create(&lsample_key, lsample_release);
+}
+
+// function to get this thread's slot, claiming a free one on first use
+static lsample_stack* lsample_slot(void) {
+    if (lsample_self || lsample_full) { return lsample_self; }
+
+    pthread_once(&lsample_key_once, lsample_key_init);
+    long tid = syscall(SYS_gettid);
+    for (int i = 0; i < LSAMPLE_THREADS; i++) {
+        long free_tid = 0;
+        if (__atomic_compare_exchange_n(&lsample_stacks[i].tid, &free_tid, tid, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            lsample_self = &lsample_stacks[i];
+            pthread_setspecific(lsample_key, lsample_self);
+            return lsample_self;
+        }
+    }
+    lsample_full = 1;
+    return NULL;
+}
+
+// a sample in the ring; seq says whether it is free to write or to read
+typedef struct {
+    unsigned long seq;
+    int depth;
+    const char* frames[LSAMPLE_DEPTH];
+} lsample;
+
+// a distinct stack and how often it was sampled
+typedef struct {
+    int depth;
+    const char** frames;
+    unsigned long count;
+    size_t hash;
+} lstackcount;
+
+static struct {
+    int on;
+    lsample ring[LSAMPLE_RING];
+    unsigned long head;     // next slot to write, claimed by handlers
+    unsigned long tail;     // next slot to read, owned by the drain
+    unsigned long dropped;
+
+    pthread_t drain;
+    int draining;
+
+    // stacks seen so far, open addressing on the hash of their frames
+    lstackcount* stacks;
+    size_t stacks_cap;
+    size_t stacks_count;
+} lsampler;
+
+// signal handler copying the interrupted thread's stack into the ring,
+// dropping the sample when the ring is full; it only reads the slot
+// registered for the thread's id
+static void lsample_signal(int sig) {
+    if (!__atomic_load_n(&lsampler.on, __ATOMIC_RELAXED)) { return; }
+
+    int saved = errno;
+    long tid = syscall(SYS_gettid);
+    errno = saved;
+    lsample_stack* self = NULL;
+    for (int i = 0; i < LSAMPLE_THREADS && !self; i++) {
+        if (__atomic_load_n(&lsample_stacks[i].tid, __ATOMIC_ACQUIRE) == tid) {
+            self = &lsample_stacks[i];
+        }
+    }
+
+    unsigned long pos = __atomic_load_n(&lsampler.head, __ATOMIC_RELAXED);
+    lsample* x;
+    while (1) {
+        x = &lsampler.ring[pos & (LSAMPLE_RING - 1)];
+        unsigned long seq = __atomic_load_n(&x->seq, __ATOMIC_ACQUIRE);
+        if (seq != pos) {
+            if (seq < pos) {
+                __atomic_add_fetch(&lsampler.dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            pos = __atomic_load_n(&lsampler.head, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&lsampler.head, &pos, pos + 1, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { break; }
+    }
+
+    // a thread that never made a sampled call is at the top level
+    int depth = self ? self->depth : 0;
+    if (depth > LSAMPLE_DEPTH) { depth = LSAMPLE_DEPTH; }
+    x->depth = depth;
+    for (int i = 0; i < depth; i++) { x->frames[i] = self->frames[i]; }
+    __atomic_store_n(&x->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// function to add one sampled stack to the counts
+static void lsample_count(const char** frames, int depth) {
+    size_t h = 2166136261u;
+    for (int i = 0; i < depth; i++) { h = (h ^ (uintptr_t)frames[i]) * 16777619u; }
+
+    if ((lsampler.stacks_count + 1) * 2 > lsampler.stacks_cap) {
+        size_t cap = lsampler.stacks_cap ? lsampler.stacks_cap * 2 : 256;
+        lstackcount* stacks = calloc(cap, sizeof(lstackcount));
+        for (size_t i = 0; i < lsampler.stacks_cap; i++) {
+            lstackcount* c = &lsampler.stacks[i];
+            if (!c->count) { continue; }
+            size_t j = c->hash & (cap - 1);
+            while (stacks[j].count) { j = (j + 1) & (cap - 1); }
+            stacks[j] = *c;
+        }
+        free(lsampler.stacks);
+        lsampler.stacks = stacks;
+        lsampler.stacks_cap = cap;
+    }
+
+    size_t i = h & (lsampler.stacks_cap - 1);
+    while (1) {
+        lstackcount* c = &lsampler.stacks[i];
+        if (!c->count) {
+            c->depth = depth;
+            c->frames = malloc(sizeof(char*) * (depth ? depth : 1));
+            memcpy(c->frames, frames, sizeof(char*) * depth);
+            c->hash = h;
+            c->count = 1;
+            lsampler.stacks_count++;
+            return;
+        }
+        if (c->hash == h && c->depth == depth &&
+            memcmp(c->frames, frames, sizeof(char*) * depth) == 0) {
+            c->count++;
+            return;
+        }
+        i = (i + 1) & (lsampler.stacks_cap - 1);
+    }
+}
+
+// function to move every finished sample from the ring into the counts
+static void lsample_drain(void) {
+    while (1) {
+        lsample* x = &lsampler.ring[lsampler.tail & (LSAMPLE_RING - 1)];
+        if (__atomic_load_n(&x->seq, __ATOMIC_ACQUIRE) != lsampler.tail + 1) { break; }
+        lsample_count(x->frames, x->depth);
+        __atomic_store_n(&x->seq, lsampler.tail + LSAMPLE_RING, __ATOMIC_RELEASE);
+        lsampler.tail++;
+    }
+}
+
+static void* lsample_thread(void* arg) {
+    struct timespec wait = { 0, 20 * 1000 * 1000 };
+    while (__atomic_load_n(&lsampler.draining, __ATOMIC_ACQUIRE)) {
+        lsample_drain();
+        nanosleep(&wait, NULL);
+    }
+    return NULL;
+}
+
+int lispy_sample_start(int hz) {
+    if (lsampler.on || hz <= 0) { return 0; }
+
+    for (unsigned long i = 0; i < LSAMPLE_RING; i++) { lsampler.ring[i].seq = i; }
+    lsampler.head = lsampler.tail = 0;
+    lsampler.dropped = 0;
+
+    // the drain thread must not be interrupted, so it starts with SIGPROF
+    // blocked and inherits that
+    sigset_t prof, old;
+    sigemptyset(&prof);
+    sigaddset(&prof, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &prof, &old);
+    lsampler.draining = 1;
+    int failed = pthread_create(&lsampler.drain, NULL, lsample_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (failed) { return 0; }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lsample_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    __atomic_store_n(&lsampler.on, 1, __ATOMIC_RELEASE);
+    struct itimerval t = { { 0, 1000000 / hz }, { 0, 1000000 / hz } };
+    setitimer(ITIMER_PROF, &t, NULL);
+    return 1;
+}
+
+void lispy_sample_stop(FILE* f) {
+    if (!lsampler.on) { return; }
+
+    struct itimerval t;
+    memset(&t, 0, sizeof(t));
+    setitimer(ITIMER_PROF, &t, NULL);
+    __atomic_store_n(&lsampler.on, 0, __ATOMIC_RELEASE);
+    // a signal still in flight would otherwise end the process
+    signal(SIGPROF, SIG_IGN);
+
+    __atomic_store_n(&lsampler.draining, 0, __ATOMIC_RELEASE);
+    pthread_join(lsampler.drain, NULL);
+    lsample_drain();
+
+    // one line per stack, frames joined outermost first, then its count
+    for (size_t i = 0; i < lsampler.stacks_cap; i++) {
+        lstackcount* c = &lsampler.stacks[i];
+        if (!c->count) { continue; }
+        if (f) {
+            if (c->depth == 0) { fputs("<toplevel>", f); }
+            for (int j = 0; j < c->depth; j++) {
+                if (j) { fputc(';', f); }
+                fputs(c->frames[j], f);
+            }
+            fprintf(f, " %lu\n", c->count);
+        }
+        free(c->frames);
+    }
+    free(lsampler.stacks);
+    lsampler.stacks = NULL;
+    lsampler.stacks_cap = lsampler.stacks_count = 0;
+
+    if (lsampler.dropped) {
+        fprintf(stderr, "sample: dropped %lu samples\n", lsampler.dropped);
+    }
+}
+
+
+// The tracer. While it runs, every call writes an entry and an exit record
+// into a ring owned by the calling thread, and a background thread copies
+// the rings to the trace file, so a traced call costs two clock reads and
+// two stores. The file is a header followed by records in the machine's
+// byte order; a function's name is written once, in a name record ahead of
+// the first record that uses it. lispy_trace_decode prints a file as text.
+
+#define LTRACE_MAGIC "LTRC0001"
+// records per thread's ring, a power of two
+#define LTRACE_RING 16384
+
+enum { LTRACE_ENTER, LTRACE_EXIT, LTRACE_NAME };
+
+// a call's entry or exit; a name record is followed by args bytes of name
+typedef struct {
+    uint64_t name;      // the name's id
+    uint64_t time;      // ns since tracing started
+    uint64_t elapsed;   // on exit, ns spent in the call
+    uint64_t allocs;    // on exit, lvals allocated in the call
+    uint32_t args;      // arguments passed
+    uint16_t depth;     // calls under way on this thread, outside this one
+    uint8_t thread;     // order in which the thread first traced
+    uint8_t kind;
+} ltrace_rec;
+
+// a thread's ring, which it fills and the flush thread empties; kept for
+// the life of the process and reused by later traces
+typedef struct ltring {
+    ltrace_rec recs[LTRACE_RING];
+    unsigned long head;
+    unsigned long tail;
+    int thread;
+    struct ltring* next;
+} ltring;
+
+static struct {
+    int on;
+    unsigned long id;       // tells traces apart, so rings join each one
+    uint64_t start;
+    FILE* f;
+
+    pthread_mutex_t lock;   // guards the list of rings
+    ltring* rings;
+    int threads;
+
+    pthread_t flush;
+    int flushing;
+
+    // names already written, open addressing on their ids
+    uint64_t* names;
+    size_t names_cap;
+    size_t names_count;
+} ltracer = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static LTHREAD_LOCAL ltring* ltrace_ring = NULL;
+static LTHREAD_LOCAL unsigned long ltrace_ring_id = 0;
+static LTHREAD_LOCAL int ltrace_depth = 0;
+
+// function to add a record to this thread's ring, waiting for the flush
+// thread to make room if it is full; records after tracing stops are dropped
+static void ltrace_push(ltrace_rec* x) {
+    unsigned long id = __atomic_load_n(&ltracer.id, __ATOMIC_ACQUIRE);
+    if (!__atomic_load_n(&ltracer.on, __ATOMIC_ACQUIRE)) { return; }
+
+    // join this trace, reusing the ring from an earlier one
+    ltring* r = ltrace_ring;
+    if (ltrace_ring_id != id) {
+        if (!r) { r = malloc(sizeof(ltring)); }
+        r->head = r->tail = 0;
+        pthread_mutex_lock(&ltracer.lock);
+        r->thread = ltracer.threads++;
+        r->next = ltracer.rings;
+        ltracer.rings = r;
+        pthread_mutex_unlock(&ltracer.lock);
+        ltrace_ring = r;
+        ltrace_ring_id = id;
+    }
+
+    unsigned long h = r->head;
+    while (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LTRACE_RING) {
+        if (!__atomic_load_n(&ltracer.on, __ATOMIC_ACQUIRE)) { return; }
+        sched_yield();
+    }
+    x->thread = r->thread;
+    r->recs[h & (LTRACE_RING - 1)] = *x;
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+// function to write a name record the first time an id is seen
+static void ltrace_name(uint64_t id) {
+    if ((ltracer.names_count + 1) * 2 > ltracer.names_cap) {
+        size_t cap = ltracer.names_cap ? ltracer.names_cap * 2 : 256;
+        uint64_t* names = calloc(cap, sizeof(uint64_t));
+        for (size_t i = 0; i < ltracer.names_cap; i++) {
+            uint64_t n = ltracer.names[i];
+            if (!n) { continue; }
+            size_t j = (n >> 3) & (cap - 1);
+            while (names[j]) { j = (j + 1) & (cap - 1); }
+            names[j] = n;
+        }
+        free(ltracer.names);
+        ltracer.names = names;
+        ltracer.names_cap = cap;
+    }
+
+    size_t i = (id >> 3) & (ltracer.names_cap - 1);
+    while (ltracer.names[i]) {
+        if (ltracer.names[i] == id) { return; }
+        i = (i + 1) & (ltracer.names_cap - 1);
+    }
+    ltracer.names[i] = id;
+    ltracer.names_count++;
+
+    // names are interned or literals, so the id is still the name
+    const char* name = (const char*)(uintptr_t)id;
+    ltrace_rec x;
+    memset(&x, 0, sizeof(x));
+    x.kind = LTRACE_NAME;
+    x.name = id;
+    x.args = strlen(name);
+    fwrite(&x, sizeof(x), 1, ltracer.f);
+    fwrite(name, 1, x.args, ltracer.f);
+}
+
+// function to copy every ring's records to the file, returning how many
+static unsigned long ltrace_flush(void) {
+    unsigned long n = 0;
+    pthread_mutex_lock(&ltracer.lock);
+    ltring* rings = ltracer.rings;
+    pthread_mutex_unlock(&ltracer.lock);
+
+    // rings are only ever added at the front, so the list can be walked
+    // without the lock
+    for (ltring* r = rings; r; r = r->next) {
+        unsigned long h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (unsigned long t = r->tail; t < h; t++) {
+            ltrace_rec* x = &r->recs[t & (LTRACE_RING - 1)];
+            ltrace_name(x->name);
+            fwrite(x, sizeof(*x), 1, ltracer.f);
+        }
+        n += h - r->tail;
+        __atomic_store_n(&r->tail, h, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+static void* ltrace_thread(void* arg) {
+    struct timespec wait = { 0, 5 * 1000 * 1000 };
+    while (__atomic_load_n(&ltracer.flushing, __ATOMIC_ACQUIRE)) {
+        if (!ltrace_flush()) { nanosleep(&wait, NULL); }
+    }
+    return NULL;
+}
+
+int lispy_trace_start(const char* path) {
+    if (ltracer.on) { return 0; }
+    ltracer.f = fopen(path, "wb");
+    if (!ltracer.f) { return 0; }
+    fwrite(LTRACE_MAGIC, 1, 8, ltracer.f);
+
+    ltracer.rings = NULL;
+    ltracer.threads = 0;
+    ltracer.start = lprof_now();
+    ltracer.flushing = 1;
+    if (pthread_create(&ltracer.flush, NULL, ltrace_thread, NULL) != 0) {
+        fclose(ltracer.f);
+        return 0;
+    }
+
+    __atomic_add_fetch(&ltracer.id, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ltracer.on, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void lispy_trace_stop(void) {
+    if (!ltracer.on) { return; }
+    __atomic_store_n(&ltracer.on, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&ltracer.flushing, 0, __ATOMIC_RELEASE);
+    pthread_join(ltracer.flush, NULL);
+    ltrace_flush();
+
+    fclose(ltracer.f);
+    free(ltracer.names);
+    ltracer.names = NULL;
+    ltracer.names_cap = ltracer.names_count = 0;
+}
+
+// function to call a function between an entry and an exit record
+static lval* ltrace_call(interp* in, lenv* e, lval* f, lval* a) {
+    ltrace_rec x;
+    x.kind = LTRACE_ENTER;
+    x.name = (uintptr_t)lval_fun_name(f);
+    x.args = a->count;
+    x.depth = ltrace_depth < UINT16_MAX ? ltrace_depth : UINT16_MAX;
+    x.elapsed = x.allocs = 0;
+    unsigned long allocs = lval_allocs;
+    uint64_t start = lprof_now();
+    x.time = start - ltracer.start;
+    ltrace_push(&x);
+
+    ltrace_depth++;
+    lprof* p = __atomic_load_n(&in->prof, __ATOMIC_ACQUIRE);
+    lval* r = p ? lprof_call(p, in, e, f, a) : lval_apply(in, e, f, a);
+    ltrace_depth--;
+
+    uint64_t end = lprof_now();
+    x.kind = LTRACE_EXIT;
+    x.time = end - ltracer.start;
+    x.elapsed = end - start;
+    x.allocs = lval_allocs - allocs;
+    ltrace_push(&x);
+    return r;
+}
+
+int lispy_trace_decode(const char* path, FILE* out) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return 0; }
+
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, LTRACE_MAGIC, 8) != 0) {
+        fclose(f);
+        return 0;
+    }
+
+    // ids and the names they were given, in a list searched from the most
+    // recent as recent names are the likeliest to come up
+    uint64_t* ids = NULL;
+    char** names = NULL;
+    size_t count = 0;
+
+    ltrace_rec x;
+    while (fread(&x, sizeof(x), 1, f) == 1) {
+        if (x.kind == LTRACE_NAME) {
+            char* name = malloc(x.args + 1);
+            name[fread(name, 1, x.args, f)] = '\0';
+            ids = realloc(ids, sizeof(uint64_t) * (count + 1));
+            names = realloc(names, sizeof(char*) * (count + 1));
+            ids[count] = x.name;
+            names[count++] = name;
+            continue;
+        }
+
+        char* name = "?";
+        for (size_t i = count; i-- > 0;) {
+            if (ids[i] == x.name) {
+                name = names[i];
+                break;
+            }
+        }
+
+        fprintf(out, "%2d %14.3f us %*s", x.thread, x.time / 1e3, 2 * x.depth, "");
+        if (x.kind == LTRACE_ENTER) {
+            fprintf(out, "> %s %u args\n", name, x.args);
+        } else {
+            fprintf(out, "< %s %.3f us %llu lvals\n", name,
+                x.elapsed / 1e3, (unsigned long long)x.allocs);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) { free(names[i]); }
+    free(names);
+    free(ids);
+    fclose(f);
+    return 1;
+}
+
+
+// function which applies a function to its arguments
+lval* lval_apply(interp* in, lenv* e, lval* f, lval* a) {
+    // if builtin then simply apply that
+    if (f->builtin) {
+        int op = lmem_enter(LMEM_BUILTIN);
+        lval* r = f->builtin(in, e, a);
+        lmem_leave(op);
+        return r;
+    }
+
+    // record argument counts
+    int given = a->count;
+    int total = f->formals->count;
+
+    // while arguments still remain to be processed
+    while (a->count) {
+        // if we've ran out of formal arguments to bind
+        if (f->formals->count == 0) {
+            lval_del(a);
+            return lval_err(
+                "function passed too many arguments "
+                "(got %i, expected: %i)", given, total
+            );
+        }
+
+        // pop the first symbol from the formals
+        lval* sym = lval_pop(f->formals, 0);
+
+        // special case to deal with '&'
+        if (strcmp(sym->sym, "&") == 0) {
+            // ensure '&' is followed by another symbol
+            if (f->formals->count != 1) {
+                lval_del(a);
+                return lval_err("function format invalid, "
+                    "symbol '&' not followed by single symbol");
+            }
+
+            // next formal should be bound to remaining arguments
+            lval* nsym = lval_pop(f->formals, 0);
+            lenv_put(f->env, nsym, builtin_list(in, e, a));
+            lval_del(sym);
+            lval_del(nsym);
+            break;
+        }
+
+        // pop the next argument from the list
+        lval* val = lval_pop(a, 0);
+
+        // bind a copy into the function's environment
+        lenv_put(f->env, sym, val);
+
+        // delete symbol and value
+        lval_del(sym);
+        lval_del(val);
+
+    }
+
+    // argument list is now bound so can be cleaned up
+    lval_del(a);
+
+    // if '&' remains in formal list then bind to empty list
+    if (f->formals->count > 0 &&
+        strcmp(f->formals->cell[0]->sym, "&") == 0) {
+
+        // check to ensure '&' is not passed invalidly
+        if (f->formals->count !=2) {
+            return lval_err("function format invalid, "
+                "symbol '&' not followed by single symbol");
+        }
+
+        // pop and delete '&' symbol
+        lval_del(lval_pop(f->formals, 0));
+
+        // pop next symbol and create empty list
+        lval* sym = lval_pop(f->formals, 0);
+        lval* val = lval_qexpr();
+
+        // bind to environment and delete
+        lenv_put(f->env, sym, val);
+        lval_del(sym);
+        lval_del(val);
+    }
+
+    // if all formal have been bound, then evaluate
+    if (f->formals->count == 0) {
+        // set environment parent to evaluation environment
+        f->env->par = e;
+
+        // evaluate and return
+        return builtin_eval(
+            in, f->env,
+            lval_add(lval_sexpr(), lval_copy(f->body))
+        );
+    }
+    else
+        // otherwise return partially evaluated function
+        return lval_copy(f);
+}
+
+
+// function which calls a function, through the profiler while one is
+// recording
+lval* lval_call(interp* in, lenv* e, lval* f, lval* a) {
+    // refuse calls nested deeper than the limit, before the C stack runs out
+    lbudget* started = NULL;
+    if (in->limited) {
+        started = lbudget_begin(in);
+        lbudget* b = lval_budget;
+        int exceeded = __atomic_load_n(&b->exceeded, __ATOMIC_RELAXED);
+        if (!exceeded && in->limits.depth && lval_depth >= in->limits.depth) {
+            exceeded = LLIMIT_DEPTH;
+            __atomic_store_n(&b->exceeded, exceeded, __ATOMIC_RELAXED);
+        }
+        if (exceeded) {
+            lval_del(a);
+            lbudget_end(started);
+            return lbudget_err(in, exceeded);
+        }
+        lval_depth++;
+    }
+
+    // keep the stack of names while the sampler runs; the name is stored
+    // before the depth that makes it visible to the signal handler
+    lsample_stack* sampled = NULL;
+    if (__atomic_load_n(&lsampler.on, __ATOMIC_RELAXED)) { sampled = lsample_slot(); }
+    if (sampled) {
+        if (sampled->depth < LSAMPLE_DEPTH) {
+            sampled->frames[sampled->depth] = lval_fun_name(f);
+        }
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        sampled->depth++;
+    }
+
+    // a lambda's body counts as evaluation even when a builtin calls it
+    int op = lmem_enter(LMEM_EVAL);
+    lval* r;
+    if (__atomic_load_n(&ltracer.on, __ATOMIC_RELAXED)) {
+        r = ltrace_call(in, e, f, a);
+    } else {
+        lprof* p = __atomic_load_n(&in->prof, __ATOMIC_ACQUIRE);
+        r = p ? lprof_call(p, in, e, f, a) : lval_apply(in, e, f, a);
+    }
+    lmem_leave(op);
+
+    if (sampled) { sampled->depth--; }
+    if (in->limited) {
+        lval_depth--;
+        lbudget_end(started);
+    }
+    return r;
+}
+
+
+// the grammar is built once and shared by every interpreter, since parsing
+// only reads it; it is freed when the last interpreter using it is deleted
+static pthread_mutex_t lgrammar_lock = PTHREAD_MUTEX_INITIALIZER;
+static int lgrammar_users = 0;
+static mpc_parser_t* lgrammar[8];
+
+enum { LG_NUMBER, LG_SYMBOL, LG_STRING, LG_COMMENT, LG_SEXPR, LG_QEXPR, LG_EXPR, LG_LISPY };
+
+// functions to build the parts of LISPY_GRAMMAR the way mpca_lang builds
+// them from its text, so the AST lval_read sees is the same: a regex or a
+// character token, a reference to another rule, and a sequence
+static mpc_parser_t* lgrammar_regex(const char* re) {
+    return mpca_state(mpca_tag(mpc_apply(mpc_tok(mpc_re(re)), mpcf_str_ast), "regex"));
+}
+
+static mpc_parser_t* lgrammar_char(char c) {
+    return mpca_state(mpca_tag(mpc_apply(mpc_tok(mpc_char(c)), mpcf_str_ast), "char"));
+}
+
+static mpc_parser_t* lgrammar_rule(int i, const char* name) {
+    return mpca_state(mpca_root(mpca_add_tag(lgrammar[i], name)));
+}
+
+static mpc_parser_t* lgrammar_seq(int n, mpc_parser_t** xs) {
+    mpc_parser_t* p = mpc_pass();
+    for (int i = 0; i < n; i++) { p = mpca_and(2, p, xs[i]); }
+    return p;
+}
+
+static void lgrammar_define(int i, mpc_parser_t* p) {
+    mpc_optimise(p);
+    mpc_define(lgrammar[i], p);
+}
+
+// function to build the grammar directly from combinators, which skips
+// parsing the grammar's text and is several times quicker than mpca_lang
+static void lgrammar_build(void) {
+    char* names[] = { "number", "symbol", "string", "comment", "sexpr", "qexpr", "expr", "lispy" };
+    for (int i = 0; i < 8; i++) { lgrammar[i] = mpc_new(names[i]); }
+
+    // the regexes as mpca_lang passes them on, with `\/` unescaped
+    mpc_parser_t* xs[3];
+    xs[0] = lgrammar_regex("-?[0-9]+");
+    lgrammar_define(LG_NUMBER, lgrammar_seq(1, xs));
+    xs[0] = lgrammar_regex("[a-zA-Z0-9_+\\-*/\\\\=<>!&]+");
+    lgrammar_define(LG_SYMBOL, lgrammar_seq(1, xs));
+    xs[0] = lgrammar_regex("\"(\\\\(.|\\n)|[^\"\\\\])*\"");
+    lgrammar_define(LG_STRING, lgrammar_seq(1, xs));
+    xs[0] = lgrammar_regex(";[^\\r\\n]*");
+    lgrammar_define(LG_COMMENT, lgrammar_seq(1, xs));
+
+    xs[0] = lgrammar_char('(');
+    xs[1] = mpca_many(lgrammar_rule(LG_EXPR, "expr"));
+    xs[2] = lgrammar_char(')');
+    lgrammar_define(LG_SEXPR, lgrammar_seq(3, xs));
+    xs[0] = lgrammar_char('{');
+    xs[1] = mpca_many(lgrammar_rule(LG_EXPR, "expr"));
+    xs[2] = lgrammar_char('}');
+    lgrammar_define(LG_QEXPR, lgrammar_seq(3, xs));
+
+    // alternatives nest to the right, as `a | b | c` reads as `a | (b | c)`
+    mpc_parser_t* alt = NULL;
+    for (int i = LG_QEXPR; i >= LG_NUMBER; i--) {
+        xs[0] = lgrammar_rule(i, names[i]);
+        mpc_parser_t* term = lgrammar_seq(1, xs);
+        alt = alt ? mpca_or(2, term, alt) : term;
+    }
+    lgrammar_define(LG_EXPR, alt);
+
+    xs[0] = lgrammar_regex("^");
+    xs[1] = mpca_many(lgrammar_rule(LG_EXPR, "expr"));
+    xs[2] = lgrammar_regex("$");
+    lgrammar_define(LG_LISPY, lgrammar_seq(3, xs));
+
+    // optimise the grammar so `or` rules pick an alternative from the next character
+    for (int i = 0; i < 8; i++) { mpc_optimise_first(lgrammar[i]); }
+}
+
+// function to give an interpreter the shared grammar, building it first
+// if no interpreter has it
+static void lgrammar_acquire(interp* in) {
+    pthread_mutex_lock(&lgrammar_lock);
+    if (lgrammar_users++ == 0) { lgrammar_build(); }
+    pthread_mutex_unlock(&lgrammar_lock);
+
+    in->number = lgrammar[LG_NUMBER];
+    in->symbol = lgrammar[LG_SYMBOL];
+    in->string = lgrammar[LG_STRING];
+    in->comment = lgrammar[LG_COMMENT];
+    in->sexpr = lgrammar[LG_SEXPR];
+    in->qexpr = lgrammar[LG_QEXPR];
+    in->expr = lgrammar[LG_EXPR];
+    in->lispy = lgrammar[LG_LISPY];
+}
+
+// function to undefine and delete the grammar once nothing uses it
+static void lgrammar_release(void) {
+    pthread_mutex_lock(&lgrammar_lock);
+    if (--lgrammar_users == 0) {
+        mpc_cleanup(8, lgrammar[0], lgrammar[1], lgrammar[2], lgrammar[3],
+            lgrammar[4], lgrammar[5], lgrammar[6], lgrammar[7]);
+    }
+    pthread_mutex_unlock(&lgrammar_lock);
+}
+
+
+// function to create an interpreter with the shared parsers and its own
+// environment
+interp* interp_new(void) {
+    interp* in = malloc(sizeof(interp));
+    lgrammar_acquire(in);
+
+    // create an environment and register builtin functions
+    in->env = lenv_new();
+    pthread_mutex_init(&in->lock, NULL);
+    in->jobs = lpool_cpus();
+    in->pool = NULL;
+    in->exec = NULL;
+    in->shared = 0;
+    in->actors = NULL;
+    in->thread = pthread_self();
+    in->prof = NULL;
+    memset(&in->limits, 0, sizeof(in->limits));
+    in->limited = 0;
+    lenv_add_builtins(in->env);
+
+    // the main script is an actor too, so actors can send it results
+    in->root = lactor_new(in, in->env, NULL);
+
+    return in;
+}
+
+
+// function to delete an interpreter
+void interp_del(interp* in) {
+    // let spawned evaluations finish while the parsers still exist
+    if (in->exec && !in->shared) { lexec_del(in->exec); }
+
+    // delete actors
+    while (in->actors) {
+        lactor* a = in->actors;
+        in->actors = a->next;
+        lactor_del(a);
+    }
+
+    // let go of the parsers
+    lgrammar_release();
+
+    // delete env
+    lenv_del(in->env);
+    if (in->pool && !in->shared) { lpool_del(in->pool); }
+    if (in->prof) { lprof_del(in->prof); }
+    pthread_mutex_destroy(&in->lock);
+    free(in);
+}
+
+
+// function to run the interpreter's work on a shared pool and executor
+void interp_share(interp* in, lpool* pool, lexec* exec) {
+    pthread_mutex_lock(&in->lock);
+    in->pool = pool;
+    in->exec = exec;
+    in->shared = 1;
+    pthread_mutex_unlock(&in->lock);
+}
+
+
+// function to evaluate in a scope of its own, waiting for what it started
+// and deleting the actors it created
+lval* interp_eval_scoped(interp* in, lenv* e, lval* v, FILE* out) {
+    lscope s = { out };
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.idle, NULL);
+
+    // actors are added at the front, so those created from here on come
+    // before this one
+    pthread_mutex_lock(&in->lock);
+    lactor* mark = in->actors;
+    pthread_mutex_unlock(&in->lock);
+
+    lscope* outer = lval_scope;
+    lval_scope = &s;
+    lval* x = lval_eval(in, e, v);
+    lval_scope = outer;
+
+    // actors are idle once no turn of theirs is queued or running
+    pthread_mutex_lock(&s.lock);
+    while (s.jobs) { pthread_cond_wait(&s.idle, &s.lock); }
+    pthread_mutex_unlock(&s.lock);
+
+    pthread_mutex_lock(&in->lock);
+    while (in->actors != mark) {
+        lactor* a = in->actors;
+        in->actors = a->next;
+        lactor_del(a);
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.idle);
+    return x;
+}
+
+
+// function to load and evaluate a file in the interpreter's environment
+lval* interp_load(interp* in, char* filename) {
+    // argument list with single argument, the file name
+    lval* args = lval_add(lval_sexpr(), lval_str(filename));
+    return builtin_load(in, in->env, args);
+}
+
+
+// function to evaluate each expression of a parse result in turn, returning
+// the last value or the first error
+static lval* interp_eval_result(interp* in, int ok, mpc_result_t* r) {
+    if (!ok) {
+        // turn the parse error into an error value without the final newline
+        char* err_msg = mpc_err_string(r->error);
+        mpc_err_delete(r->error);
+        size_t n = strlen(err_msg);
+        if (n && err_msg[n - 1] == '\n') { err_msg[n - 1] = '\0'; }
+        lval* err = lval_err("%s", err_msg);
+        free(err_msg);
+        return err;
+    }
+
+    lval* expr = lval_read(r->output);
+    mpc_ast_delete(r->output);
+
+    lval* x = lval_sexpr();
+    while (expr->count) {
+        lval_del(x);
+        x = lval_eval(in, in->env, lval_pop(expr, 0));
+        if (x->type == LVAL_ERR) { break; }
+    }
+
+    lval_del(expr);
+    return x;
+}
+
+
+lval* interp_eval_string(interp* in, char* filename, char* input) {
+    mpc_result_t r;
+    int ok = mpc_parse(filename, input, in->lispy, &r);
+    return interp_eval_result(in, ok, &r);
+}
+
+
+lval* interp_eval_file(interp* in, char* filename) {
+    mpc_result_t r;
+    int ok = mpc_parse_contents(filename, in->lispy, &r);
+    return interp_eval_result(in, ok, &r);
+}
+
+
+// state of reading top-level forms from a stream: the buffer holds
+// [start, len) unconsumed, and scanning has got as far as pos
+typedef struct {
+    char* buf;
+    size_t start;
+    size_t pos;
+    size_t len;
+    size_t cap;
+    int depth;      // open brackets
+    int string;     // inside a string
+    int escape;     // after a backslash in a string
+    int comment;    // inside a comment
+    int atom;       // inside a number or symbol at the top level
+    mpc_state_t at; // where start is in the stream, for parse errors
+} lreader;
+
+
+// function to scan on from pos, returning the end of the first complete
+// form, or 0 if more input is needed
+static size_t lreader_scan(lreader* r) {
+    for (; r->pos < r->len; r->pos++) {
+        char c = r->buf[r->pos];
+
+        if (r->comment) {
+            if (c == '\n') { r->comment = 0; }
+            continue;
+        }
+
+        if (r->string) {
+            if (r->escape) { r->escape = 0; }
+            else if (c == '\\') { r->escape = 1; }
+            else if (c == '"') {
+                r->string = 0;
+                if (r->depth == 0) { return ++r->pos; }
+            }
+            continue;
+        }
+
+        // an atom at the top level ends at anything that can't be in it
+        int space = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        if (r->atom && (space || strchr("(){}\";", c))) {
+            r->atom = 0;
+            return r->pos;
+        }
+
+        switch (c) {
+            case ';': r->comment = 1; break;
+            case '"': r->string = 1; break;
+            case '(': case '{': r->depth++; break;
+            case ')': case '}':
+                // a stray closer is a form of its own, for the parser to reject
+                if (r->depth <= 1) {
+                    r->depth = 0;
+                    return ++r->pos;
+                }
+                r->depth--;
+                break;
+            default:
+                if (!space && r->depth == 0) { r->atom = 1; }
+        }
+    }
+    return 0;
+}
+
+
+// function to parse and evaluate the text [start, end) of the buffer,
+// printing the value of each expression in it
+static void lreader_eval(interp* in, lreader* r, size_t end) {
+    char saved = r->buf[end];
+    r->buf[end] = '\0';
+
+    mpc_result_t res;
+    if (mpc_parse("<stdin>", r->buf + r->start, in->lispy, &res)) {
+        lval* expr = lval_read(res.output);
+        mpc_ast_delete(res.output);
+        while (expr->count) {
+            lval* x = lval_eval(in, in->env, lval_pop(expr, 0));
+            lval_println(x);
+            lval_del(x);
+        }
+        lval_del(expr);
+    } else {
+        // the parser saw the form on its own, so report where it is in
+        // the stream instead
+        mpc_state_t* s = &res.error->state;
+        if (s->row == 0) { s->col += r->at.col; }
+        s->row += r->at.row;
+        s->pos += r->at.pos;
+
+        char* err_msg = mpc_err_string(res.error);
+        fputs(err_msg, LOUT);
+        free(err_msg);
+        mpc_err_delete(res.error);
+    }
+
+    for (size_t i = r->start; i < end; i++) {
+        r->at.pos++;
+        r->at.col++;
+        if (r->buf[i] == '\n') {
+            r->at.col = 0;
+            r->at.row++;
+        }
+    }
+
+    r->buf[end] = saved;
+    r->start = end;
+}
+
+
+void interp_eval_stream(interp* in, FILE* f) {
+    lreader r = { malloc(65536), 0, 0, 0, 65536, 0, 0, 0, 0, 0, { 0, 0, 0, 0 } };
+
+    while (1) {
+        size_t end;
+        while ((end = lreader_scan(&r))) { lreader_eval(in, &r, end); }
+
+        // move what is left to the front, growing for forms bigger than the buffer
+        memmove(r.buf, r.buf + r.start, r.len - r.start);
+        r.pos -= r.start;
+        r.len -= r.start;
+        r.start = 0;
+        if (r.len + 1 >= r.cap) {
+            r.cap *= 2;
+            r.buf = realloc(r.buf, r.cap);
+        }
+
+        size_t n = fread(r.buf + r.len, 1, r.cap - r.len - 1, f);
+        if (n == 0) { break; }
+        r.len += n;
+    }
+
+    // whatever remains at the end is evaluated as it is
+    if (r.len > r.start) { lreader_eval(in, &r, r.len); }
+    free(r.buf);
+}
+
+
+// function which registers a builtin function with the interpreter's globals
+void interp_add_builtin(interp* in, char* name, lbuiltin func) {
+    lenv_add_builtin(in->env, name, func);
+}
+
+
+// state of a multi-file load: each file's expressions, or error
+typedef struct {
+    interp* in;
+    char** filenames;
+    lval** exprs;
+    int isolated;
+} lload;
+
+
+// task parsing file i, and evaluating it as well when isolated
+static void lload_file(void* ctx, int i, int w) {
+    lload* l = ctx;
+    // '-' is streamed from stdin in its place in the order
+    if (strcmp(l->filenames[i], "-") == 0) { l->exprs[i] = NULL; return; }
+    l->exprs[i] = lval_read_file(l->in, l->filenames[i]);
+    if (!l->isolated || l->exprs[i]->type == LVAL_ERR) { return; }
+
+    // a root environment of its own holding copies of the globals
+    lenv* e = lenv_copy(l->in->env);
+    lval_eval_each(l->in, e, l->exprs[i]);
+    lenv_del(e);
+    l->exprs[i] = NULL;
+}
+
+
+void interp_load_files(interp* in, char** filenames, int count, int isolated) {
+    lload l = { in, filenames, malloc(sizeof(lval*) * (count ? count : 1)), isolated };
+
+    lpool_run(interp_pool(in), count, lload_file, &l);
+
+    // evaluate in command line order, reporting files that failed to parse
+    for (int i = 0; i < count; i++) {
+        if (strcmp(filenames[i], "-") == 0) { interp_eval_stream(in, stdin); continue; }
+        if (!l.exprs[i]) { continue; }
+        if (l.exprs[i]->type == LVAL_ERR) {
+            lval_println(l.exprs[i]);
+            lval_del(l.exprs[i]);
+        } else {
+            lval_eval_each(in, in->env, l.exprs[i]);
+        }
+    }
+
+    free(l.exprs);
+}
+
+
+// a heap image holds a global environment as a table of nodes, one per
+// lval or environment, which refer to their children and to a pool of
+// strings by index rather than by pointer; restoring one maps the file in
+// and builds each node's lval from its children, turning the indices back
+// into pointers
+#define LIMAGE_MAGIC "LIMG0001"
+
+// kinds of node besides the lval types
+enum { LIMAGE_BUILTIN = LVAL_TYPES, LIMAGE_LAMBDA, LIMAGE_ENV };
+
+typedef struct {
+    char magic[8];
+    uint32_t nodes;     // nodes, the global environment first
+    uint32_t links;     // indices of children
+    uint32_t strs;      // bytes of strings
+    uint32_t pad;
+} limage_header;
+
+// a node holds a number's low 32 bits in a and high ones in b; the string
+// of a symbol, string or error, or a builtin's name, at offset a of the
+// pool; the b children of a list from link a on, or the b bindings of an
+// environment as pairs of name and value; or a lambda's formals, body and
+// environment as nodes a, a + 1 and a + 2, with its name at b - 1 unless b
+// is 0. children always come after their parent
+typedef struct {
+    uint32_t type;
+    uint32_t a, b;
+} limage_node;
+
+// an image being written, with the lval or environment each node is for
+typedef struct {
+    limage_node* nodes;
+    lval** vals;
+    lenv** envs;
+    uint32_t count, cap;
+    uint32_t* links;
+    uint32_t links_count, links_cap;
+    char* strs;
+    uint32_t strs_len, strs_cap;
+    // offsets of the strings so far, hashed so each is stored once
+    uint32_t* seen;
+    uint32_t seen_count, seen_cap;
+} limage;
+
+// function to add a string to the pool, returning its offset
+static uint32_t limage_str(limage* w, const char* s) {
+    if ((w->seen_count + 1) * 2 > w->seen_cap) {
+        uint32_t cap = w->seen_cap ? w->seen_cap * 2 : 256;
+        uint32_t* seen = malloc(sizeof(uint32_t) * cap);
+        memset(seen, 0xff, sizeof(uint32_t) * cap);
+        for (uint32_t i = 0; i < w->seen_cap; i++) {
+            if (w->seen[i] == UINT32_MAX) { continue; }
+            size_t j = lname_hash(w->strs + w->seen[i]) & (cap - 1);
+            while (seen[j] != UINT32_MAX) { j = (j + 1) & (cap - 1); }
+            seen[j] = w->seen[i];
+        }
+        free(w->seen);
+        w->seen = seen;
+        w->seen_cap = cap;
+    }
+
+    size_t j = lname_hash(s) & (w->seen_cap - 1);
+    for (; w->seen[j] != UINT32_MAX; j = (j + 1) & (w->seen_cap - 1)) {
+        if (strcmp(w->strs + w->seen[j], s) == 0) { return w->seen[j]; }
+    }
+
+    uint32_t n = strlen(s) + 1;
+    while (w->strs_len + n > w->strs_cap) {
+        w->strs_cap = w->strs_cap ? w->strs_cap * 2 : 4096;
+        w->strs = realloc(w->strs, w->strs_cap);
+    }
+    memcpy(w->strs + w->strs_len, s, n);
+    w->seen[j] = w->strs_len;
+    w->seen_count++;
+    w->strs_len += n;
+    return w->seen[j];
+}
+
+// function to add a node for an lval or an environment, to be filled in
+// when its turn comes
+static uint32_t limage_add(limage* w, lval* v, lenv* e) {
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 256;
+        w->nodes = realloc(w->nodes, sizeof(limage_node) * w->cap);
+        w->vals = realloc(w->vals, sizeof(lval*) * w->cap);
+        w->envs = realloc(w->envs, sizeof(lenv*) * w->cap);
+    }
+    memset(&w->nodes[w->count], 0, sizeof(limage_node));
+    w->vals[w->count] = v;
+    w->envs[w->count] = e;
+    return w->count++;
+}
+
+static void limage_link(limage* w, uint32_t x) {
+    if (w->links_count == w->links_cap) {
+        w->links_cap = w->links_cap ? w->links_cap * 2 : 256;
+        w->links = realloc(w->links, sizeof(uint32_t) * w->links_cap);
+    }
+    w->links[w->links_count++] = x;
+}
+
+// function to fill in node i, adding nodes for its children; returns an
+// error for values that cannot be saved
+static lval* limage_fill(limage* w, uint32_t i) {
+    limage_node x = { 0, 0, 0 };
+    lenv* e = w->envs[i];
+    lval* v = w->vals[i];
+
+    if (e) {
+        // actors belong to their interpreter, so the globals' handles to
+        // them, like self, are left out
+        x.type = LIMAGE_ENV;
+        x.a = w->links_count;
+        for (int j = 0; j < e->count; j++) {
+            if (i == 0 && e->vals[j]->type == LVAL_ACTOR) { continue; }
+            // reserve the links first, as the values' nodes are added after
+            limage_link(w, limage_str(w, e->syms[j]));
+            limage_link(w, 0);
+            x.b++;
+        }
+        for (int j = 0, k = 0; j < e->count; j++) {
+            if (i == 0 && e->vals[j]->type == LVAL_ACTOR) { continue; }
+            w->links[x.a + 2 * k++ + 1] = limage_add(w, e->vals[j], NULL);
+        }
+        w->nodes[i] = x;
+        return NULL;
+    }
+
+    x.type = v->type;
+    switch (v->type) {
+        case LVAL_NUM:
+            x.a = (uint32_t)((uint64_t)v->num & 0xffffffff);
+            x.b = (uint32_t)((uint64_t)v->num >> 32);
+            break;
+        case LVAL_SYM: x.a = limage_str(w, v->sym); break;
+        case LVAL_STR: x.a = limage_str(w, v->str); break;
+        case LVAL_ERR: x.a = limage_str(w, v->err); break;
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x.a = w->links_count;
+            x.b = v->count;
+            for (int j = 0; j < v->count; j++) { limage_link(w, 0); }
+            for (int j = 0; j < v->count; j++) {
+                w->links[x.a + j] = limage_add(w, v->cell[j], NULL);
+            }
+            break;
+
+        case LVAL_FUN:
+            // builtins are found again by name when the image is restored
+            if (v->builtin) {
+                if (!v->name) { return lval_err("cannot save an unnamed builtin in an image"); }
+                x.type = LIMAGE_BUILTIN;
+                x.a = limage_str(w, v->name);
+                break;
+            }
+            x.type = LIMAGE_LAMBDA;
+            x.a = limage_add(w, v->formals, NULL);
+            limage_add(w, v->body, NULL);
+            limage_add(w, NULL, v->env);
+            x.b = v->name ? limage_str(w, v->name) + 1 : 0;
+            break;
+
+        default:
+            return lval_err("cannot save a value of type '%s' in an image", ltype_name(v->type));
+    }
+    w->nodes[i] = x;
+    return NULL;
+}
+
+// function to write the environment e and everything it holds to path
+static lval* limage_save(lenv* e, char* path) {
+    limage w;
+    memset(&w, 0, sizeof(w));
+
+    // nodes are filled in the order they were added, so every child
+    // comes after its parent
+    lval* err = NULL;
+    limage_add(&w, NULL, e);
+    for (uint32_t i = 0; i < w.count && !err; i++) { err = limage_fill(&w, i); }
+
+    if (!err) {
+        limage_header h;
+        memcpy(h.magic, LIMAGE_MAGIC, 8);
+        h.nodes = w.count;
+        h.links = w.links_count;
+        h.strs = w.strs_len;
+        h.pad = 0;
+
+        FILE* f = fopen(path, "wb");
+        int ok = f != NULL;
+        ok = ok && fwrite(&h, sizeof(h), 1, f) == 1;
+        ok = ok && fwrite(w.nodes, sizeof(limage_node), w.count, f) == w.count;
+        ok = ok && fwrite(w.links, sizeof(uint32_t), w.links_count, f) == w.links_count;
+        ok = ok && fwrite(w.strs, 1, w.strs_len, f) == w.strs_len;
+        if (f && fclose(f) != 0) { ok = 0; }
+        if (!ok) { err = lval_err("could not write image '%s'", path); }
+    }
+
+    free(w.nodes);
+    free(w.vals);
+    free(w.envs);
+    free(w.links);
+    free(w.strs);
+    free(w.seen);
+    return err ? err : lval_sexpr();
+}
+
+lval* interp_save_image(interp* in, char* path) {
+    return limage_save(in->env, path);
+}
+
+lval* builtin_save_image(interp* in, lenv* e, lval* a) {
+    LASSERT_NUM("save-image", a, 1);
+    LASSERT_TYPE("save-image", a, 0, LVAL_STR);
+
+    // the image holds the globals wherever it is saved from
+    while (e->par) { e = e->par; }
+    lval* r = limage_save(e, a->cell[0]->str);
+    lval_del(a);
+    return r;
+}
+
+// function to find the builtin registered under a name, among those every
+// interpreter has and those added to this one
+static lbuiltin limage_builtin(interp* in, const char* name) {
+    for (size_t i = 0; i < LBUILTINS; i++) {
+        if (strcmp(lbuiltins[i].name, name) == 0) { return lbuiltins[i].func; }
+    }
+    for (int i = 0; i < in->env->count; i++) {
+        lval* v = in->env->vals[i];
+        if (v->type == LVAL_FUN && v->builtin && v->name && strcmp(v->name, name) == 0) {
+            return v->builtin;
+        }
+    }
+    return NULL;
+}
+
+// function to check that the names of an environment node, already known
+// to be in the pool, are all different, as restoring one relies on it
+static int limage_unique(const limage_node* x, const uint32_t* links, const char* strs) {
+    size_t cap = 16;
+    while (cap < (size_t)x->b * 2) { cap *= 2; }
+    uint32_t* seen = malloc(sizeof(uint32_t) * cap);
+    memset(seen, 0xff, sizeof(uint32_t) * cap);
+
+    int ok = 1;
+    for (uint32_t j = 0; j < x->b && ok; j++) {
+        const char* name = strs + links[x->a + 2 * j];
+        size_t k = lname_hash(name) & (cap - 1);
+        while (seen[k] != UINT32_MAX && (ok = strcmp(strs + seen[k], name) != 0)) {
+            k = (k + 1) & (cap - 1);
+        }
+        seen[k] = links[x->a + 2 * j];
+    }
+    free(seen);
+    return ok;
+}
+
+// function to check that a mapped image is well formed before anything is
+// built from it: every index in range, every node but the first the child
+// of exactly one earlier node, environments only where they belong, and
+// every builtin known
+static int limage_check(interp* in, const limage_header* h, const limage_node* nodes,
+    const uint32_t* links, const char* strs) {
+    if (h->nodes == 0 || nodes[0].type != LIMAGE_ENV) { return 0; }
+    if (h->strs == 0 || strs[h->strs - 1] != '\0') { return 0; }
+
+    char* used = calloc(h->nodes, 1);
+    int ok = 1;
+
+    // claim node x as a child of node i, an environment or not
+    #define LIMAGE_CHILD(x, env) \
+        if ((x) <= i || (x) >= h->nodes || used[x] || \
+            ((nodes[x].type == LIMAGE_ENV) != (env))) { ok = 0; break; } \
+        used[x] = 1;
+
+    for (uint32_t i = 0; i < h->nodes && ok; i++) {
+        const limage_node* x = &nodes[i];
+        switch (x->type) {
+            case LVAL_NUM:
+                break;
+
+            case LVAL_SYM:
+            case LVAL_STR:
+            case LVAL_ERR:
+                ok = x->a < h->strs;
+                break;
+
+            case LIMAGE_BUILTIN:
+                ok = x->a < h->strs && limage_builtin(in, strs + x->a);
+                break;
+
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                ok = x->a <= h->links && x->b <= h->links - x->a;
+                for (uint32_t j = 0; j < x->b && ok; j++) {
+                    LIMAGE_CHILD(links[x->a + j], 0);
+                }
+                break;
+
+            case LIMAGE_ENV:
+                ok = x->a <= h->links && x->b <= (h->links - x->a) / 2;
+                for (uint32_t j = 0; j < x->b && ok; j++) {
+                    if (links[x->a + 2 * j] >= h->strs) { ok = 0; break; }
+                    LIMAGE_CHILD(links[x->a + 2 * j + 1], 0);
+                }
+                if (ok) { ok = limage_unique(x, links, strs); }
+                break;
+
+            case LIMAGE_LAMBDA:
+                ok = x->b <= h->strs && x->a < h->nodes && h->nodes - x->a > 2;
+                if (!ok) { break; }
+                LIMAGE_CHILD(x->a, 0);
+                LIMAGE_CHILD(x->a + 1, 0);
+                LIMAGE_CHILD(x->a + 2, 1);
+
+                // calls take the formals and body apart as a Q-Expression
+                // of symbols and a Q-Expression
+                const limage_node* formals = &nodes[x->a];
+                ok = formals->type == LVAL_QEXPR && nodes[x->a + 1].type == LVAL_QEXPR &&
+                    formals->a <= h->links && formals->b <= h->links - formals->a;
+                for (uint32_t j = 0; j < formals->b && ok; j++) {
+                    uint32_t f = links[formals->a + j];
+                    ok = f < h->nodes && nodes[f].type == LVAL_SYM;
+                }
+                break;
+
+            default:
+                ok = 0;
+        }
+    }
+    #undef LIMAGE_CHILD
+
+    for (uint32_t i = 1; i < h->nodes && ok; i++) { ok = used[i]; }
+    free(used);
+    return ok;
+}
+
+static char* limage_strdup(const char* s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(malloc(n), s, n);
+}
+
+// function to build the lval or environment of every node, the last first,
+// so each node's children are built before it and are taken over by it
+static lenv* limage_build(interp* in, const limage_header* h, const limage_node* nodes,
+    const uint32_t* links, const char* strs) {
+    void** made = malloc(sizeof(void*) * h->nodes);
+
+    for (uint32_t i = h->nodes; i-- > 0;) {
+        const limage_node* x = &nodes[i];
+        lval* v = NULL;
+        switch (x->type) {
+            case LVAL_NUM:
+                v = lval_num((long)((uint64_t)x->b << 32 | x->a));
+                break;
+
+            case LVAL_SYM:
+                v = lval_new(LVAL_SYM);
+                v->sym = limage_strdup(strs + x->a);
+                lval_bytes += strlen(v->sym) + 1;
+                break;
+
+            case LVAL_STR:
+                v = lval_new(LVAL_STR);
+                v->str = limage_strdup(strs + x->a);
+                lval_bytes += strlen(v->str) + 1;
+                break;
+
+            case LVAL_ERR:
+                v = lval_new(LVAL_ERR);
+                v->err = limage_strdup(strs + x->a);
+                lval_bytes += strlen(v->err) + 1;
+                break;
+
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                v = lval_new(x->type);
+                v->count = x->b;
+                v->cell = x->b ? malloc(sizeof(lval*) * x->b) : NULL;
+                lval_bytes += sizeof(lval*) * x->b;
+                for (uint32_t j = 0; j < x->b; j++) { v->cell[j] = made[links[x->a + j]]; }
+                break;
+
+            case LIMAGE_BUILTIN:
+                v = lval_fun(limage_builtin(in, strs + x->a));
+                v->name = lname_intern(strs + x->a);
+                break;
+
+            case LIMAGE_LAMBDA:
+                v = lval_new(LVAL_FUN);
+                v->builtin = NULL;
+                v->formals = made[x->a];
+                v->body = made[x->a + 1];
+                v->env = made[x->a + 2];
+                v->name = x->b ? lname_intern(strs + x->b - 1) : NULL;
+                break;
+
+            case LIMAGE_ENV: {
+                lenv* e = lenv_new();
+                e->count = x->b;
+                e->syms = malloc(sizeof(char*) * (x->b ? x->b : 1));
+                e->vals = malloc(sizeof(lval*) * (x->b ? x->b : 1));
+                for (uint32_t j = 0; j < x->b; j++) {
+                    e->syms[j] = limage_strdup(strs + links[x->a + 2 * j]);
+                    e->vals[j] = made[links[x->a + 2 * j + 1]];
+                }
+                made[i] = e;
+                continue;
+            }
+        }
+        made[i] = v;
+    }
+
+    lenv* e = made[0];
+    free(made);
+    return e;
+}
+
+lval* interp_load_image(interp* in, char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) { close(fd); }
+        return lval_err("could not open image '%s'", path);
+    }
+    size_t size = st.st_size;
+    void* p = size >= sizeof(limage_header) ?
+        mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) { return lval_err("'%s' is not an image", path); }
+
+    // the sections follow the header, each aligned for what it holds
+    const limage_header* h = p;
+    const limage_node* nodes = (const limage_node*)(h + 1);
+    const uint32_t* links = (const uint32_t*)(nodes + h->nodes);
+    const char* strs = (const char*)(links + h->links);
+    int ok = memcmp(h->magic, LIMAGE_MAGIC, 8) == 0 &&
+        h->nodes <= (size - sizeof(*h)) / sizeof(limage_node) &&
+        h->links <= (size - sizeof(*h) - h->nodes * sizeof(limage_node)) / sizeof(uint32_t) &&
+        size - sizeof(*h) - h->nodes * sizeof(limage_node) - h->links * sizeof(uint32_t) == h->strs &&
+        limage_check(in, h, nodes, links, strs);
+    if (!ok) {
+        munmap(p, size);
+        return lval_err("'%s' is not an image", path);
+    }
+
+    int op = lmem_enter(LMEM_READ);
+    lenv* img = limage_build(in, h, nodes, links, strs);
+    lmem_leave(op);
+    munmap(p, size);
+
+    // move the bindings into the globals, replacing any already there;
+    // the image's names are distinct, so only the existing ones are searched
+    lenv* e = in->env;
+    int existing = e->count;
+    e->syms = realloc(e->syms, sizeof(char*) * (existing + img->count));
+    e->vals = realloc(e->vals, sizeof(lval*) * (existing + img->count));
+    for (int i = 0; i < img->count; i++) {
+        int j = 0;
+        while (j < existing && strcmp(e->syms[j], img->syms[i]) != 0) { j++; }
+        if (j < existing) {
+            free(img->syms[i]);
+            lval_del(e->vals[j]);
+            e->vals[j] = img->vals[i];
+        } else {
+            e->syms[e->count] = img->syms[i];
+            e->vals[e->count++] = img->vals[i];
+        }
+    }
+    free(img->syms);
+    free(img->vals);
+    free(img);
+    return lval_sexpr();
+}
+
+int lval_type(lval* v) { return v->type; }
+
+long lval_to_num(lval* v) { return v->type == LVAL_NUM ? v->num : 0; }
+
+// contents of a string, symbol or error, otherwise NULL
+char* lval_to_str(lval* v) {
+    switch (v->type) {
+        case LVAL_STR: return v->str;
+        case LVAL_SYM: return v->sym;
+        case LVAL_ERR: return v->err;
+    }
+    return NULL;
+}
+
+// number of items in an S-expression or Q-expression
+int lval_count(lval* v) {
+    return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) ? v->count : 0;
+}
+
+lval* lval_cell(lval* v, int i) {
+    return (i >= 0 && i < lval_count(v)) ? v->cell[i] : NULL;
+}
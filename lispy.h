@@ -1,13 +1,50 @@
 #ifndef REPL_HEADER
+#define REPL_HEADER
 
+#include <pthread.h>
 #include "mpc.h"
+#include "pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// grammar for the language; the interpreter builds the same parsers from
+// combinators at startup, the benchmarks from this text with mpca_lang
+#define LISPY_GRAMMAR "\
+            number   : /-?[0-9]+/ ;\
+            symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;\
+            string   : /\"(\\\\(.|\\n)|[^\"\\\\])*\"/ ;\
+            comment  : /;[^\\r\\n]*/ ;\
+            sexpr    : '(' <expr>* ')' ;\
+            qexpr    : '{' <expr>* '}' ;\
+            expr     : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ;\
+            lispy    : /^/ <expr>* /$/ ;\
+            "
 
 typedef struct lval lval;
 
+// create enumeration of possible lval types
+enum {LVAL_NUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_ERR, LVAL_FUN,
+    LVAL_STR, LVAL_FUT, LVAL_ACTOR};
+
+// create enumeration of possible error types
+enum {LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM};
+
 typedef struct lenv lenv;
 
+// the result of a spawned evaluation, shared by every copy of its value
+typedef struct lfuture lfuture;
+
+// an actor with its own environment and mailbox, owned by its interpreter
+typedef struct lactor lactor;
+
+// call counts and timings per function, see interp_profile_start
+typedef struct lprof lprof;
+
 struct lenv {
     lenv* par;
+    int top;        // def stops here though there is a parent
     int count;
     char** syms;
     lval** vals;
@@ -25,7 +62,148 @@ void lenv_def(lenv* e, lval* k, lval* v);
 
 lenv* lenv_copy(lenv* e);
 
-typedef lval*(*lbuiltin)(lenv*, lval*);
+lenv* lenv_flatten(lenv* e);
+
+typedef struct interp interp;
+
+// resources an evaluation may use before it is stopped with an error, 0 for
+// no limit; they apply to each top-level expression together with the
+// parallel calls, futures and actor messages it starts, and the heap counts
+// the bytes of lvals, strings and lists it keeps alive
+typedef struct {
+    unsigned long steps;    // expressions evaluated
+    int depth;              // nested function calls, on each thread
+    size_t heap;            // bytes of lvals and what they own
+    unsigned long timeout;  // milliseconds of wall-clock time
+} llimits;
+
+// an interpreter instance owns its global environment and shares the
+// read-only grammar, so several can run independently on separate threads
+// in one process
+struct interp {
+    mpc_parser_t* number;
+    mpc_parser_t* symbol;
+    mpc_parser_t* string;
+    mpc_parser_t* comment;
+    mpc_parser_t* sexpr;
+    mpc_parser_t* qexpr;
+    mpc_parser_t* expr;
+    mpc_parser_t* lispy;
+    lenv* env;
+    // worker threads for the parallel builtins and for spawned futures,
+    // started on first use under lock
+    pthread_mutex_t lock;
+    int jobs;       // worker threads, one per processor unless set before use
+    lpool* pool;
+    lexec* exec;
+    int shared;     // pool and exec belong to the caller, see interp_share
+    // every actor created, and the one standing for the main script,
+    // which receives on the thread that created the interpreter
+    lactor* actors;
+    lactor* root;
+    pthread_t thread;
+    // the profile being recorded, or NULL
+    lprof* prof;
+    // limits on every evaluation, set before evaluating with interp_limit
+    llimits limits;
+    int limited;
+};
+
+interp* interp_new(void);
+
+// limit the resources every evaluation in the interpreter may use
+void interp_limit(interp* in, llimits* limits);
+
+void interp_del(interp* in);
+
+// run the interpreter's parallel builtins, futures and actors on a pool and
+// executor several interpreters share; call before evaluating anything, and
+// delete them only after every interpreter using them
+void interp_share(interp* in, lpool* pool, lexec* exec);
+
+lval* interp_load(interp* in, char* filename);
+
+// write the global environment, with every value and lambda in it, to a
+// heap image; values that cannot be saved, like futures, give an error
+lval* interp_save_image(interp* in, char* path);
+
+// add the definitions of a heap image to the global environment, replacing
+// those of the same name; the image must come from a build with the same
+// byte order and have only builtins this interpreter knows
+lval* interp_load_image(interp* in, char* path);
+
+// embedding API: evaluate every expression of a string or file in the
+// interpreter's global environment, returning the value of the last one
+// or the first error, which the caller deletes with lval_del
+lval* interp_eval_string(interp* in, char* filename, char* input);
+
+lval* interp_eval_file(interp* in, char* filename);
+
+// evaluate v in e like lval_eval as an evaluation of its own: it and the
+// futures and actors it starts print to out, and the call returns once all
+// of them have finished, with the actors it created deleted, so nothing it
+// started outlives it; any actors left in e or the value are no longer
+// valid, and the caller deletes the value with lval_del
+lval* interp_eval_scoped(interp* in, lenv* e, lval* v, FILE* out);
+
+// evaluate the top-level forms of a stream one at a time as each one is
+// read in full, printing their values
+void interp_eval_stream(interp* in, FILE* f);
+
+// load several files like the load builtin, parsing them in parallel on the
+// worker pool and then evaluating them in order into the global environment;
+// isolated files are instead each evaluated concurrently in their own copy
+// of the globals, and their definitions are discarded; a file named '-'
+// is streamed from stdin into the globals like interp_eval_stream, in its
+// place in the order
+void interp_load_files(interp* in, char** filenames, int count, int isolated);
+
+// record the calls of every function from now on, per name under which it
+// was defined, clearing any earlier profile; this and the report should be
+// called while no other thread is evaluating
+void interp_profile_start(interp* in);
+
+// print the recorded functions, at most limit of them (all for 0), in
+// order of time spent in the function itself
+void interp_profile_report(interp* in, FILE* f, int limit);
+
+// count every lval allocated from now on, per type and operation, over
+// every interpreter in the process; allocations are not counted until this
+// is called, so they cost nothing extra
+void lispy_mem_start(void);
+
+// whether lispy_mem_start has been called
+int lispy_mem_counting(void);
+
+// print how many lvals of each type have been allocated, per operation
+// they were allocated for, since lispy_mem_start
+void lispy_mem_report(FILE* f);
+
+// total lvals allocated since lispy_mem_start
+unsigned long lispy_mem_allocated(void);
+
+// sample the call stack of whichever thread is running hz times a second of
+// CPU time, for the whole process; returns 0 if it could not start
+int lispy_sample_start(int hz);
+
+// stop sampling and write the stacks seen, in flame graph folded format,
+// to f unless it is NULL
+void lispy_sample_stop(FILE* f);
+
+// trace every call, from any thread, into a binary file written in the
+// background; returns 0 if the file could not be opened
+int lispy_trace_start(const char* path);
+
+void lispy_trace_stop(void);
+
+// print a trace file as text, one line per call entry or exit; returns 0
+// if it is not a trace
+int lispy_trace_decode(const char* path, FILE* out);
+
+// a builtin takes ownership of its argument list and returns a new value
+typedef lval*(*lbuiltin)(interp*, lenv*, lval*);
+
+void interp_add_builtin(interp* in, char* name, lbuiltin func);
 
 typedef struct lval {
     int type;
@@ -42,10 +220,46 @@ typedef struct lval {
     // expression
     int count;
     lval** cell;
+    // future
+    lfuture* fut;
+    // actor
+    lactor* actor;
+    // name a function was defined or registered under, interned
+    const char* name;
 } lval;
 
+// a pending step when walking nested lvals with an explicit stack,
+// so deeply nested lists can't overflow the C stack
+typedef struct {
+    lval* v;        // value to visit
+    lval* w;        // its copy, or the value it is compared with
+    mpc_ast_t* t;   // AST node the value is read from
+    char c;         // character printed when there is no value
+} lstep;
+
+#define LSTACK_LOCAL 16
+
+typedef struct {
+    int count;
+    int cap;
+    lstep* steps;
+    lstep local[LSTACK_LOCAL];
+} lstack;
+
+void lstack_init(lstack* s);
+
+void lstack_push(lstack* s, lval* v, lval* w, mpc_ast_t* t, char c);
+
+lstep lstack_pop(lstack* s);
+
+void lstack_free(lstack* s);
+
+lval* lval_copy_node(lval* v);
+
 lval* lval_copy(lval* v);
 
+lval* lval_new(int type);
+
 lval* lval_fun(lbuiltin func);
 
 lval* lval_lambda(lval* formals, lval* body);
@@ -80,67 +294,142 @@ lval* lval_read_str(mpc_ast_t* t);
 
 lval* lval_add(lval* v, lval* x);
 
+lval* lval_read_node(mpc_ast_t* t);
+
 lval* lval_read(mpc_ast_t* t);
 
+// a growable string values are printed into, so each print is written out
+// in one go; short strings stay in the local storage
+#define LBUF_LOCAL 256
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    char local[LBUF_LOCAL];
+} lbuf;
+
+void lbuf_init(lbuf* b);
+
+void lbuf_reserve(lbuf* b, size_t n);
+
+void lbuf_free(lbuf* b);
+
+void lbuf_write(lbuf* b, const char* s, size_t n);
+
+void lbuf_putc(lbuf* b, char c);
+
+void lbuf_puts(lbuf* b, const char* s);
+
+void lbuf_num(lbuf* b, long x);
+
+void lbuf_escape(lbuf* b, const char* s);
+
+void lval_print_buf(lbuf* b, lval* v);
+
+// number of characters lval_print_buf writes for v
+size_t lval_print_len(lval* v);
+
+// v as it would be printed, in a new string the caller frees
+char* lval_show(lval* v);
+
 void lval_print(lval* v);
 
-void lval_expr_print(lval* v, char open, char close);
+void lval_expr_print(lbuf* b, lstack* s, lval* v, char open, char close);
+
+void lval_print_str(lbuf* b, lval* v);
 
-void lval_print_str(lval* v);
+FILE* lval_output(FILE* f);
 
 void lval_println(lval* v);
 
-lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval(interp* in, lenv* e, lval* v);
 
 lval* lval_pop(lval* v, int i);
 
 lval* lval_take(lval* v, int i);
 
-lval* builtin_add(lenv* e, lval* a);
+lval* builtin_add(interp* in, lenv* e, lval* a);
+
+lval* builtin_sub(interp* in, lenv* e, lval* a);
+
+lval* builtin_mul(interp* in, lenv* e, lval* a);
+
+lval* builtin_div(interp* in, lenv* e, lval* a);
+
+lval* builtin_len(interp* in, lenv* e, lval* a);
+
+lval* builtin_head(interp* in, lenv* e, lval* a);
+
+lval* builtin_tail(interp* in, lenv* e, lval* a);
 
-lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_list(interp* in, lenv* e, lval* a);
 
-lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_eval(interp* in, lenv* e, lval* a);
 
-lval* builtin_div(lenv* e, lval* a);
+lval* builtin_join(interp* in, lenv* e, lval* a);
 
-lval* builtin_len(lenv* e, lval* a);
+lval* builtin_def(interp* in, lenv* e, lval* a);
 
-lval* builtin_head(lenv* e, lval* a);
+lval* builtin_put(interp* in, lenv* e, lval* a);
 
-lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_var(interp* in, lenv* e, lval* a, char* func);
 
-lval* builtin_list(lenv* e, lval* a);
+lval* builtin_gt(interp* in, lenv* e, lval* a);
 
-lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_lt(interp* in, lenv* e, lval* a);
 
-lval* builtin_join(lenv* e, lval* a);
+lval* builtin_ge(interp* in, lenv* e, lval* a);
 
-lval* builtin_def(lenv* e, lval* a);
+lval* builtin_le(interp* in, lenv* e, lval* a);
 
-lval* builtin_put(lenv* e, lval* a);
+lval* builtin_ord(interp* in, lenv* e, lval* a, char* op);
 
-lval* builtin_var(lenv* e, lval* a, char* func);
+lval* builtin_cmp(interp* in, lenv* e, lval* a, char* op);
 
-lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_if(interp* in, lenv* e, lval* a);
 
-lval* builtin_lt(lenv* e, lval* a);
+lval* lval_read_file(interp* in, char* filename);
 
-lval* builtin_ge(lenv* e, lval* a);
+void lval_eval_each(interp* in, lenv* e, lval* expr);
 
-lval* builtin_le(lenv* e, lval* a);
+lval* builtin_load(interp* in, lenv* e, lval* a);
 
-lval* builtin_ord(lenv* e, lval* a, char* op);
+lval* builtin_print(interp* in, lenv* e, lval* a);
 
-lval* builtin_cmp(lenv* e, lval* a, char* op);
+lval* builtin_show(interp* in, lenv* e, lval* a);
 
-lval* builtin_if(lenv* e, lval* a);
+lval* builtin_profile_start(interp* in, lenv* e, lval* a);
 
-lval* builtin_load(lenv* e, lval* a);
+lval* builtin_profile_report(interp* in, lenv* e, lval* a);
 
-lval* builtin_print(lenv* e, lval* a);
+lval* builtin_mem_stats(interp* in, lenv* e, lval* a);
 
-lval* builtin_error(lenv* e, lval* a);
+lval* builtin_save_image(interp* in, lenv* e, lval* a);
+
+lval* builtin_error(interp* in, lenv* e, lval* a);
+
+lval* builtin_pmap(interp* in, lenv* e, lval* a);
+
+lval* builtin_pfilter(interp* in, lenv* e, lval* a);
+
+lval* builtin_preduce(interp* in, lenv* e, lval* a);
+
+lval* lval_fut(lfuture* f);
+
+lval* builtin_spawn(interp* in, lenv* e, lval* a);
+
+lval* builtin_await(interp* in, lenv* e, lval* a);
+
+lval* lval_actor(lactor* a);
+
+lval* builtin_actor(interp* in, lenv* e, lval* a);
+
+lval* builtin_send(interp* in, lenv* e, lval* a);
+
+lval* builtin_receive(interp* in, lenv* e, lval* a);
+
+int lval_eq_node(lstack* s, lval* x, lval* y);
 
 int lval_eq(lval* x, lval* y);
 
@@ -148,14 +437,33 @@ lval* lval_join(lval* x, lval* y);
 
 lval* builtin(lval* a, char* func);
 
-lval* builtin_op(lenv* e, lval* a, char* op);
+lval* builtin_op(interp* in, lenv* e, lval* a, char* op);
+
+lval* lval_call(interp* in, lenv* e, lval* f, lval* a);
+
+lval* lval_apply(interp* in, lenv* e, lval* f, lval* a);
 
-lval* lval_call(lenv*e, lval* f, lval* a);
+const char* lname_intern(const char* s);
 
-lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_eval_sexpr(interp* in, lenv* e, lval* v);
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
 
 void lenv_add_builtins(lenv* e);
 
+// value accessors for embedders
+int lval_type(lval* v);
+
+long lval_to_num(lval* v);
+
+char* lval_to_str(lval* v);
+
+int lval_count(lval* v);
+
+lval* lval_cell(lval* v, int i);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -1,5 +1,12 @@
 #include "mpc.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#include <pthread.h>
+#endif
+
 /*
 ** State Type
 */
@@ -75,13 +82,71 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/*
+** The small-object pool used by `mpc_malloc`
+** is 32KB, which dwarfs the work needed to parse
+** a typical REPL line. To keep `mpc_parse` cheap
+** the pool is only allocated on the first small
+** allocation, and a released input (pool, marks
+** and all) is kept in a per-thread cache so the
+** next parse on that thread can reuse it without
+** touching the allocator.
+**
+** String inputs also borrow the caller's buffer
+** and filename rather than copying them, as both
+** outlive the call to `mpc_parse`.
+*/
+
+/*
+** Parsers marked with `mpc_memoise` cache their
+** result per input position (packrat parsing) so
+** that backtracking alternatives which re-run the
+** same rule at the same offset only pay for it once.
+**
+** The cache is a direct-mapped table of fixed
+** size hanging off the input, so memory use is
+** bounded no matter how large the input is - a
+** colliding entry simply evicts the older one.
+*/
+
+enum {
+  MPC_MEMO_SLOTS = 4096
+};
+
+typedef struct {
+  mpc_parser_t *parser;
+  long pos;
+  int suppress;
+  int ok;
+  mpc_state_t end;
+  char last;
+  mpc_ast_t *output;
+  mpc_err_t *error;
+  mpc_err_t *delta;
+} mpc_memo_entry_t;
+
+typedef struct {
+  int used;
+  mpc_memo_entry_t entries[MPC_MEMO_SLOTS];
+} mpc_memo_t;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MPC_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define MPC_THREAD_LOCAL __declspec(thread)
+#else
+#define MPC_THREAD_LOCAL
+#endif
+
 typedef struct {
 
   int type;
-  char *filename;
+  const char *filename;
   mpc_state_t state;
 
   char *string;
+  int string_owned;
+  long length;
   char *buffer;
   FILE *file;
 
@@ -95,134 +160,119 @@ typedef struct {
   char last;
 
   size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  char *mem_full;
+  mpc_mem_t *mem;
+
+  mpc_memo_t *memo;
 
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static MPC_THREAD_LOCAL mpc_input_t *mpc_input_cache = NULL;
+static MPC_THREAD_LOCAL mpc_memo_stats_t mpc_memo_counters;
+
+static void mpc_thread_keep(void);
+
+static void mpc_memo_entry_clear(mpc_memo_entry_t *m) {
+  if (m->parser == NULL) { return; }
+  if (m->output) { mpc_ast_delete(m->output); }
+  if (m->error) { mpc_err_delete(m->error); }
+  if (m->delta) { mpc_err_delete(m->delta); }
+  memset(m, 0, sizeof(mpc_memo_entry_t));
+}
+
+static void mpc_memo_clear(mpc_memo_t *memo) {
+  int j;
+  if (memo == NULL || memo->used == 0) { return; }
+  for (j = 0; j < MPC_MEMO_SLOTS; j++) { mpc_memo_entry_clear(&memo->entries[j]); }
+  memo->used = 0;
+}
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+static mpc_input_t *mpc_input_new(const char *filename, int type) {
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  mpc_input_t *i = mpc_input_cache;
 
+  if (i) {
+    mpc_input_cache = NULL;
+  } else {
+    i = malloc(sizeof(mpc_input_t));
+    i->marks_slots = MPC_INPUT_MARKS_MIN;
+    i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = malloc(sizeof(char) * i->marks_slots);
+    i->mem_full = NULL;
+    i->mem = NULL;
+    i->memo = NULL;
+  }
+
+  i->filename = filename;
+  i->type = type;
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = NULL;
+  i->string_owned = 0;
+  i->length = -1;
   i->buffer = NULL;
   i->file = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
   i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
-
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
-
-  i->state = mpc_state_new();
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
+  i->string = (char*)string;
+  return i;
+}
 
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
   i->string = malloc(length + 1);
+  i->string_owned = 1;
   strncpy(i->string, string, length);
   i->string[length] = '\0';
-  i->buffer = NULL;
-  i->file = NULL;
-
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
-
 }
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
-
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-
-  i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
-
-  i->string = NULL;
-  i->buffer = NULL;
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_PIPE);
   i->file = pipe;
-
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
-
 }
 
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
-
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
-
-  i->string = NULL;
-  i->buffer = NULL;
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_FILE);
   i->file = file;
-
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
 }
 
-static void mpc_input_delete(mpc_input_t *i) {
+static void mpc_input_free(mpc_input_t *i);
 
-  free(i->filename);
+static void mpc_input_delete(mpc_input_t *i) {
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  if (i->string_owned) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
+  mpc_memo_clear(i->memo);
+
+  if (mpc_input_cache == NULL) {
+    if (i->mem_full) { memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM); }
+    mpc_input_cache = i;
+    mpc_thread_keep();
+    return;
+  }
+
+  mpc_input_free(i);
+}
+
+static void mpc_input_free(mpc_input_t *i) {
+  free(i->mem_full);
+  free(i->mem);
+  free(i->memo);
   free(i->marks);
   free(i->lasts);
   free(i);
@@ -230,6 +280,7 @@ static void mpc_input_delete(mpc_input_t *i) {
 
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
   return
+    i->mem != NULL &&
     (char*)p >= (char*)(i->mem) &&
     (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
 }
@@ -240,6 +291,11 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
 
   if (n > sizeof(mpc_mem_t)) { return malloc(n); }
 
+  if (i->mem == NULL) {
+    i->mem_full = calloc(MPC_INPUT_MEM_NUM, sizeof(char));
+    i->mem = malloc(sizeof(mpc_mem_t) * MPC_INPUT_MEM_NUM);
+  }
+
   j = i->mem_index;
   do {
     if (!i->mem_full[i->mem_index]) {
@@ -597,14 +653,18 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
+/*
+** The quoted form of a plain character is written to the caller's
+** buffer (at least 4 bytes) so that errors can be built on many
+** threads at once.
+*/
 
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *buffer) {
 
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
 
   switch (c) {
     case '\a': return "bell";
@@ -617,8 +677,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
 
 }
@@ -629,6 +689,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0;
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char unescaped[4];
 
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -653,7 +714,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -714,6 +775,27 @@ static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
   mpc_free(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  *y = *x;
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  return y;
+}
+
 static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   int j;
   for (j = 0; j < x->expected_num; j++) {
@@ -866,7 +948,34 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
 }
 
 static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
+
+  int k;
   mpc_err_t *errs[2];
+
+  /* Without failures merge in place, as `mpc_err_or` would */
+  if (x == NULL && y && !y->failure) { return y; }
+  if (y == NULL && x && !x->failure) { return x; }
+
+  if (x && y && !x->failure && !y->failure) {
+
+    if (y->state.pos > x->state.pos) {
+      mpc_err_delete_internal(i, x);
+      return y;
+    }
+
+    if (y->state.pos == x->state.pos) {
+      for (k = 0; k < y->expected_num; k++) {
+        if (!mpc_err_contains_expected(i, x, y->expected[k])) {
+          mpc_err_add_expected(i, x, y->expected[k]);
+        }
+      }
+      x->received = y->received;
+    }
+
+    mpc_err_delete_internal(i, y);
+    return x;
+  }
+
   errs[0] = x;
   errs[1] = y;
   return mpc_err_or(i, errs, 2);
@@ -910,9 +1019,110 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_DFA        = 29
 };
 
+/*
+** A regex compiled by `mpc_re_mode` into a table
+** driven DFA. Bytes are first mapped to classes
+** (bytes no pattern position tells apart share a
+** class) and `trans` is indexed by state and class,
+** with -1 as the dead state.
+**
+** For each state `expected` is what a run that
+** stops there reports it wanted next, and `stop`
+** lists the (at most four) bytes that leave a state
+** which otherwise loops on itself, so long runs of
+** such a state can be skipped with a vector scan.
+*/
+
+enum {
+  MPC_DFA_STOP_MAX = 4
+};
+
+typedef struct {
+  int states;
+  int classes;
+  unsigned char cls[256];
+  short *trans;
+  char *accept;
+  int *expected_num;
+  char ***expected;
+  unsigned char *stop_num;
+  unsigned char *stop;
+} mpc_dfa_t;
+
+static void *mpc_dfa_memdup(const void *x, size_t n) {
+  void *y = malloc(n);
+  memcpy(y, x, n);
+  return y;
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  int j, k;
+  for (j = 0; j < d->states; j++) {
+    for (k = 0; k < d->expected_num[j]; k++) { free(d->expected[j][k]); }
+    free(d->expected[j]);
+  }
+  free(d->expected);
+  free(d->expected_num);
+  free(d->trans);
+  free(d->accept);
+  free(d->stop_num);
+  free(d->stop);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *a) {
+  int j, k;
+  mpc_dfa_t *d = mpc_dfa_memdup(a, sizeof(mpc_dfa_t));
+  d->trans = mpc_dfa_memdup(a->trans, sizeof(short) * a->states * a->classes);
+  d->accept = mpc_dfa_memdup(a->accept, a->states);
+  d->stop_num = mpc_dfa_memdup(a->stop_num, a->states);
+  d->stop = mpc_dfa_memdup(a->stop, a->states * MPC_DFA_STOP_MAX);
+  d->expected_num = mpc_dfa_memdup(a->expected_num, sizeof(int) * a->states);
+  d->expected = malloc(sizeof(char**) * a->states);
+  for (j = 0; j < a->states; j++) {
+    d->expected[j] = malloc(sizeof(char*) * a->expected_num[j]);
+    for (k = 0; k < a->expected_num[j]; k++) {
+      d->expected[j][k] = mpc_dfa_memdup(a->expected[j][k], strlen(a->expected[j][k]) + 1);
+    }
+  }
+  return d;
+}
+
+/*
+** For an `or` whose alternatives can be analysed,
+** `mpc_optimise_first` records the bytes each one
+** can start with. An alternative marked in `skip`
+** fails without consuming input on any other byte,
+** reporting exactly the `expected` strings listed.
+*/
+
+typedef struct {
+  int n;
+  unsigned char *skip;
+  unsigned char (*bytes)[32];
+  int *expected_num;
+  char ***expected;
+} mpc_first_t;
+
+static void mpc_first_delete(mpc_first_t *f) {
+  int j, k;
+  if (f == NULL) { return; }
+  for (j = 0; j < f->n; j++) {
+    for (k = 0; k < f->expected_num[j]; k++) { free(f->expected[j][k]); }
+    free(f->expected[j]);
+  }
+  free(f->expected);
+  free(f->expected_num);
+  free(f->bytes);
+  free(f->skip);
+  free(f);
+}
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -928,8 +1138,9 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; mpc_first_t *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -949,6 +1160,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -956,6 +1168,7 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char memo;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1028,37 +1241,355 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
+/*
+** Running a compiled regex. Only string inputs
+** are scanned directly - for file and pipe inputs,
+** and any match the DFA rejects, this returns 0 and
+** the regex's original combinator tree is run, so
+** failures report the same errors they always did.
+**
+** On success the tree would have merged into `e`
+** what it expected at the point it gave up, so we
+** report the same from the state the scan stopped in.
+*/
+
+#if defined(__SSE2__)
+static int mpc_dfa_ctz(int x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  while (!(x & 1)) { x >>= 1; n++; }
+  return n;
+#endif
+}
+#endif
+
+static long mpc_dfa_scan(mpc_dfa_t *d, int st, const unsigned char *s, long pos, long len) {
+
+  const short *row = d->trans + st * d->classes;
+
+#if defined(__SSE2__)
+  const unsigned char *stop = d->stop + st * MPC_DFA_STOP_MAX;
+  __m128i c0 = _mm_set1_epi8((char)stop[0]);
+  __m128i c1 = _mm_set1_epi8((char)stop[1]);
+  __m128i c2 = _mm_set1_epi8((char)stop[2]);
+  __m128i c3 = _mm_set1_epi8((char)stop[3]);
+  __m128i v, m;
+  int bits;
+
+  while (pos + 16 <= len) {
+    v = _mm_loadu_si128((const __m128i*)(s + pos));
+    m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+      _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+    bits = _mm_movemask_epi8(m);
+    if (bits) { return pos + mpc_dfa_ctz(bits); }
+    pos += 16;
+  }
+#endif
+
+  while (pos < len && row[d->cls[s[pos]]] == st) { pos++; }
+  return pos;
+}
+
+static void mpc_dfa_advance(mpc_state_t *t, const char *s, long to) {
+  for (; t->pos < to; t->pos++) {
+    if (s[t->pos] == '\n') { t->row++; t->col = 0; }
+    else { t->col++; }
+  }
+}
+
+static int mpc_dfa_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  mpc_dfa_t *d = p->data.dfa.d;
+  const unsigned char *s = (const unsigned char*)i->string;
+  long start, pos, end, len;
+  int st, nx, j;
+  mpc_state_t stop;
+  mpc_err_t *x;
+  char *o;
+
+  /* Without backtracking the tree keeps what a failed match consumed */
+  if (i->type != MPC_INPUT_STRING || i->backtrack < 1) { return 0; }
+  if (i->length < 0) { i->length = (long)strlen(i->string); }
+
+  len = i->length;
+  start = pos = i->state.pos;
+  st = 0;
+  end = d->accept[0] ? start : -1;
+
+  while (pos < len) {
+    if (d->stop_num[st]) {
+      pos = mpc_dfa_scan(d, st, s, pos, len);
+      if (d->accept[st]) { end = pos; }
+      if (pos == len) { break; }
+    }
+    nx = d->trans[st * d->classes + d->cls[s[pos]]];
+    if (nx < 0) { break; }
+    st = nx;
+    pos++;
+    if (d->accept[st]) { end = pos; }
+  }
+
+  if (end < 0) { return 0; }
+
+  mpc_dfa_advance(&i->state, i->string, end);
+  if (end > start) { i->last = i->string[end-1]; }
+
+  if (!i->suppress && d->expected_num[st] && (*e == NULL || (*e)->state.pos <= pos)) {
+    stop = i->state;
+    mpc_dfa_advance(&stop, i->string, pos);
+    x = mpc_malloc(i, sizeof(mpc_err_t));
+    x->filename = mpc_malloc(i, strlen(i->filename) + 1);
+    strcpy(x->filename, i->filename);
+    x->state = stop;
+    x->expected_num = 0;
+    x->expected = NULL;
+    x->failure = NULL;
+    x->received = i->string[pos];
+    for (j = 0; j < d->expected_num[st]; j++) {
+      mpc_err_add_expected(i, x, d->expected[st][j]);
+    }
+    *e = mpc_err_merge(i, *e, x);
+  }
+
+  o = mpc_malloc(i, end - start + 1);
+  memcpy(o, i->string + start, end - start);
+  o[end - start] = '\0';
+  r->output = o;
+  return 1;
+}
+
+/*
+** A memoised parser records, along with its
+** result, the errors it merged into the running
+** error `e` (its "delta") so that a cache hit
+** reports exactly the same expected-sets as a
+** real run would have.
+*/
+
+static mpc_memo_entry_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p) {
+  size_t h;
+  if (i->memo == NULL) { i->memo = calloc(1, sizeof(mpc_memo_t)); }
+  h = ((size_t)p >> 4) ^ ((size_t)i->state.pos * 2654435761u);
+  return &i->memo->entries[h % MPC_MEMO_SLOTS];
+}
+
+static int mpc_memo_hit(mpc_input_t *i, mpc_parser_t *p, mpc_memo_entry_t *m) {
+  return m->parser == p && m->pos == i->state.pos && m->suppress == (i->suppress > 0);
+}
+
+static int mpc_memo_replay(mpc_input_t *i, mpc_memo_entry_t *m, mpc_result_t *r, mpc_err_t **e) {
+
+  mpc_memo_counters.hits++;
+  *e = mpc_err_merge(i, *e, mpc_err_copy(m->delta));
+
+  if (!m->ok) {
+    r->error = mpc_err_copy(m->error);
+    return 0;
+  }
+
+  i->state = m->end;
+  i->last = m->last;
+  if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+  r->output = mpc_ast_copy(m->output);
+  return 1;
+}
+
+static void mpc_memo_store(mpc_input_t *i, mpc_parser_t *p, mpc_memo_entry_t *m,
+  long pos, int x, mpc_result_t *r, mpc_err_t *outer, mpc_err_t **e) {
+
+  if (m->parser) { mpc_memo_counters.evictions++; i->memo->used--; }
+  mpc_memo_entry_clear(m);
+  m->parser = p;
+  m->pos = pos;
+  m->suppress = i->suppress > 0;
+  m->ok = x;
+  m->end = i->state;
+  m->last = i->last;
+  m->output = x ? mpc_ast_copy(r->output) : NULL;
+  m->error = x ? NULL : mpc_err_copy(r->error);
+  m->delta = mpc_err_copy(*e);
+  i->memo->used++;
+
+  *e = mpc_err_merge(i, outer, *e);
+}
+
+/*
+** Alternatives that cannot start with the next byte
+** are skipped. Their errors are gathered in `skipped`
+** and merged in order, so the result is the same as
+** trying each of them.
+*/
+
+static int mpc_first_skip(mpc_input_t *i, mpc_parser_t *p, int j, unsigned char c,
+  mpc_err_t **skipped, mpc_err_t **e) {
+
+  int k;
+  mpc_first_t *f = p->data.or.first;
+
+  if (f == NULL || !f->skip[j] || (f->bytes[j][c / 8] & (1 << (c % 8)))) { return 0; }
+
+  /* Errors behind one already further on would be dropped */
+  if (i->suppress || (*e && (*e)->state.pos > i->state.pos)) { return 1; }
+
+  for (k = 0; k < f->expected_num[j]; k++) {
+    if (*skipped == NULL) {
+      *skipped = mpc_err_new(i, f->expected[j][k]);
+    } else if (!mpc_err_contains_expected(i, *skipped, f->expected[j][k])) {
+      mpc_err_add_expected(i, *skipped, f->expected[j][k]);
+    }
+  }
+
+  return 1;
+}
+
+/*
+** The Parse Engine
+**
+** Parsers are run with an explicit stack of frames
+** rather than by recursing on the C stack, so how
+** deeply the input nests is bounded by memory alone.
+**
+** Entering a parser either gives a result straight
+** away or pushes a frame for it and enters one of
+** its children. Each result is handed back to the
+** frame on top of the stack, which then decides to
+** enter another child or to finish with a result of
+** its own.
+*/
+
 enum {
-  MPC_PARSE_STACK_MIN = 4
+  MPC_PARSE_STACK_MIN = 4,
+  MPC_PARSE_FRAMES_MIN = 64
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
+typedef struct {
+  mpc_parser_t *p;
+  int j;
+  int slots;
+  mpc_result_t *results;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+  /* `or` */
+  unsigned char c;
+  mpc_err_t *skipped;
+  /* Memoisation */
+  int memo;
+  mpc_memo_entry_t *m;
+  long pos;
+  mpc_err_t *outer;
+} mpc_frame_t;
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_frame_t *frames;
+  mpc_frame_t frames_stk[MPC_PARSE_FRAMES_MIN];
+} mpc_stack_t;
+
+static mpc_frame_t *mpc_stack_push(mpc_stack_t *s, mpc_parser_t *p) {
+
+  mpc_frame_t *f;
+
+  if (s->num == s->slots) {
+    s->slots = s->slots * 2;
+    if (s->frames == s->frames_stk) {
+      s->frames = malloc(sizeof(mpc_frame_t) * s->slots);
+      memcpy(s->frames, s->frames_stk, sizeof(mpc_frame_t) * s->num);
+    } else {
+      s->frames = realloc(s->frames, sizeof(mpc_frame_t) * s->slots);
+    }
+  }
+
+  f = &s->frames[s->num++];
+  f->p = p;
+  f->j = 0;
+  f->slots = MPC_PARSE_STACK_MIN;
+  f->results = NULL;
+  f->skipped = NULL;
+  f->memo = 0;
+  return f;
+}
+
+static void mpc_stack_pop(mpc_input_t *i, mpc_stack_t *s) {
+  mpc_frame_t *f = &s->frames[--s->num];
+  if (f->results) { mpc_free(i, f->results); }
+}
+
+static mpc_val_t **mpc_frame_results(mpc_frame_t *f) {
+  return (mpc_val_t**)(f->results ? f->results : f->results_stk);
+}
+
+static void mpc_frame_add(mpc_input_t *i, mpc_frame_t *f, mpc_val_t *x) {
+  if (f->j == f->slots) {
+    f->slots = f->j + f->j / 2;
+    if (f->results == NULL) {
+      f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->slots);
+      memcpy(f->results, f->results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+    } else {
+      f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->slots);
+    }
+  }
+  mpc_frame_results(f)[f->j++] = x;
+}
+
+#define MPC_SUCCESS(v) x.output = v; ok = 1; goto leave
+#define MPC_FAILURE(v) x.error = v; ok = 0; goto leave
+#define MPC_PRIMITIVE(v) \
+  if (v) { ok = 1; goto leave; } \
   else { MPC_FAILURE(NULL); }
 
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  int k, ok;
+  mpc_result_t x;
+  mpc_stack_t s;
+  mpc_frame_t *f;
+  mpc_memo_entry_t *m;
+
+  s.num = 0;
+  s.slots = MPC_PARSE_FRAMES_MIN;
+  s.frames = s.frames_stk;
+
+enter:
+
+  if (p->memo && i->type != MPC_INPUT_PIPE) {
+    m = mpc_memo_slot(i, p);
+    if (mpc_memo_hit(i, p, m)) {
+      ok = mpc_memo_replay(i, m, &x, e);
+      goto leave;
+    }
+    mpc_memo_counters.misses++;
+    f = mpc_stack_push(&s, p);
+    f->memo = 1;
+    f->m = m;
+    f->pos = i->state.pos;
+    f->outer = *e;
+    *e = NULL;
+  }
 
   switch (p->type) {
 
     /* Basic Parsers */
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&x.output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&x.output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&x.output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&x.output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&x.output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&x.output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&x.output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&x.output));
+    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&x.output));
+    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&x.output));
+
+    case MPC_TYPE_DFA:
+      if (mpc_dfa_run(i, p, &x, e)) { ok = 1; goto leave; }
+      p = p->data.dfa.x;
+      goto enter;
 
     /* Other parsers */
 
@@ -1071,75 +1602,148 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
     /* Application Parsers */
 
+    case MPC_TYPE_APPLY:      mpc_stack_push(&s, p); p = p->data.apply.x;      goto enter;
+    case MPC_TYPE_APPLY_TO:   mpc_stack_push(&s, p); p = p->data.apply_to.x;   goto enter;
+    case MPC_TYPE_CHECK:      mpc_stack_push(&s, p); p = p->data.check.x;      goto enter;
+    case MPC_TYPE_CHECK_WITH: mpc_stack_push(&s, p); p = p->data.check_with.x; goto enter;
+
+    case MPC_TYPE_EXPECT:
+      mpc_stack_push(&s, p);
+      mpc_input_suppress_enable(i);
+      p = p->data.expect.x;
+      goto enter;
+
+    case MPC_TYPE_PREDICT:
+      mpc_stack_push(&s, p);
+      mpc_input_backtrack_disable(i);
+      p = p->data.predict.x;
+      goto enter;
+
+    /* Optional Parsers */
+
+    case MPC_TYPE_NOT:
+      mpc_stack_push(&s, p);
+      mpc_input_mark(i);
+      mpc_input_suppress_enable(i);
+      p = p->data.not.x;
+      goto enter;
+
+    case MPC_TYPE_MAYBE:
+      mpc_stack_push(&s, p);
+      p = p->data.not.x;
+      goto enter;
+
+    /* Repeat Parsers */
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_stack_push(&s, p);
+      p = p->data.repeat.x;
+      goto enter;
+
+    /* Combinatory Parsers */
+
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      f = mpc_stack_push(&s, p);
+      if (p->data.or.first) { f->c = (unsigned char)mpc_input_peekc(i); }
+      goto alternative;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      mpc_stack_push(&s, p);
+      mpc_input_mark(i);
+      p = p->data.and.xs[0];
+      goto enter;
+
+    /* End */
+
+    default:
+
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+
+alternative:
+
+  f = &s.frames[s.num-1];
+  p = f->p;
+
+  while (f->j < p->data.or.n && mpc_first_skip(i, p, f->j, f->c, &f->skipped, e)) { f->j++; }
+  if (f->skipped) { *e = mpc_err_merge(i, *e, f->skipped); f->skipped = NULL; }
+
+  if (f->j == p->data.or.n) {
+    mpc_stack_pop(i, &s);
+    MPC_FAILURE(NULL);
+  }
+
+  p = p->data.or.xs[f->j];
+  goto enter;
+
+leave:
+
+  if (s.num == 0) {
+    if (s.frames != s.frames_stk) { free(s.frames); }
+    *r = x;
+    return ok;
+  }
+
+  f = &s.frames[s.num-1];
+  p = f->p;
+
+  if (f->memo) {
+    mpc_memo_store(i, p, f->m, f->pos, ok, &x, f->outer, e);
+    mpc_stack_pop(i, &s);
+    goto leave;
+  }
+
+  switch (p->type) {
+
     case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+      mpc_stack_pop(i, &s);
+      if (ok) { x.output = mpc_parse_apply(i, p->data.apply.f, x.output); }
+      goto leave;
 
     case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+      mpc_stack_pop(i, &s);
+      if (ok) { x.output = mpc_parse_apply_to(i, p->data.apply_to.f, x.output, p->data.apply_to.d); }
+      goto leave;
 
     case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
+      mpc_stack_pop(i, &s);
+      if (ok && !p->data.check.f(&x.output)) {
+        mpc_parse_dtor(i, p->data.check.dx, x.output);
+        MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
       }
+      goto leave;
 
     case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
+      mpc_stack_pop(i, &s);
+      if (ok && !p->data.check_with.f(&x.output, p->data.check_with.d)) {
+        mpc_parse_dtor(i, p->data.check.dx, x.output);
+        MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
       }
+      goto leave;
 
     case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+      mpc_stack_pop(i, &s);
+      mpc_input_suppress_disable(i);
+      if (!ok) { MPC_FAILURE(mpc_err_new(i, p->data.expect.m)); }
+      goto leave;
 
     case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
-
-    /* Optional Parsers */
+      mpc_stack_pop(i, &s);
+      mpc_input_backtrack_enable(i);
+      goto leave;
 
     /* TODO: Update Not Error Message */
 
     case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      mpc_stack_pop(i, &s);
+      if (ok) {
         mpc_input_rewind(i);
         mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
+        mpc_parse_dtor(i, p->data.not.dx, x.output);
         MPC_FAILURE(mpc_err_new(i, "opposite"));
       } else {
         mpc_input_unmark(i);
@@ -1148,144 +1752,89 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
 
     case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
-
-    /* Repeat Parsers */
+      mpc_stack_pop(i, &s);
+      if (ok) { goto leave; }
+      *e = mpc_err_merge(i, *e, x.error);
+      MPC_SUCCESS(p->data.not.lf());
 
     case MPC_TYPE_MANY:
-
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-
-      *e = mpc_err_merge(i, *e, results[j].error);
-
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-
     case MPC_TYPE_MANY1:
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
+      if (ok) {
+        mpc_frame_add(i, f, x.output);
+        p = p->data.repeat.x;
+        goto enter;
       }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-
-        *e = mpc_err_merge(i, *e, results[j].error);
-
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (p->type == MPC_TYPE_MANY1 && f->j == 0) {
+        mpc_stack_pop(i, &s);
+        MPC_FAILURE(mpc_err_many1(i, x.error));
       }
 
-    case MPC_TYPE_COUNT:
+      *e = mpc_err_merge(i, *e, x.error);
+      x.output = mpc_parse_fold(i, p->data.repeat.f, f->j, mpc_frame_results(f));
+      mpc_stack_pop(i, &s);
+      ok = 1;
+      goto leave;
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+    case MPC_TYPE_COUNT:
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+      if (ok) {
+        mpc_frame_add(i, f, x.output);
+        if (f->j < p->data.repeat.n) {
+          p = p->data.repeat.x;
+          goto enter;
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        x.output = mpc_parse_fold(i, p->data.repeat.f, f->j, mpc_frame_results(f));
+        mpc_stack_pop(i, &s);
+        goto leave;
       }
 
-    /* Combinatory Parsers */
+      for (k = 0; k < f->j; k++) {
+        mpc_parse_dtor(i, p->data.repeat.dx, mpc_frame_results(f)[k]);
+      }
+      mpc_stack_pop(i, &s);
+      MPC_FAILURE(mpc_err_count(i, x.error, p->data.repeat.n));
 
     case MPC_TYPE_OR:
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
-
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
+      if (ok) {
+        mpc_stack_pop(i, &s);
+        goto leave;
       }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      *e = mpc_err_merge(i, *e, x.error);
+      f->j++;
 
-    case MPC_TYPE_AND:
-
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      /* Without backtracking a failure may have consumed input */
+      if (p->data.or.first && i->backtrack < 1) { f->c = (unsigned char)mpc_input_peekc(i); }
+      goto alternative;
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+    case MPC_TYPE_AND:
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (ok) {
+        mpc_frame_add(i, f, x.output);
+        if (f->j < p->data.and.n) {
+          p = p->data.and.xs[f->j];
+          goto enter;
         }
+        mpc_input_unmark(i);
+        x.output = mpc_parse_fold(i, p->data.and.f, f->j, mpc_frame_results(f));
+        mpc_stack_pop(i, &s);
+        goto leave;
       }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
 
-    /* End */
+      mpc_input_rewind(i);
+      for (k = 0; k < f->j; k++) {
+        mpc_parse_dtor(i, p->data.and.dxs[k], mpc_frame_results(f)[k]);
+      }
+      mpc_stack_pop(i, &s);
+      goto leave;
 
     default:
-
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
-  }
-
-  return 0;
+      mpc_stack_pop(i, &s);
+      goto leave;
+  }
 
 }
 
@@ -1339,9 +1888,31 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+/*
+** `mpc_parse_contents` reads the whole file into
+** memory and parses it as a string. File inputs
+** pay for an `fgetc` and `fseek` on every peek,
+** and string inputs are also the only ones the
+** compiled regex scanners can run directly over.
+*/
+
+static char *mpc_file_contents(FILE *f) {
+  char *s;
+  long l;
+  if (fseek(f, 0, SEEK_END) != 0) { return NULL; }
+  l = ftell(f);
+  if (l < 0 || fseek(f, 0, SEEK_SET) != 0) { return NULL; }
+  s = malloc(l + 1);
+  if ((long)fread(s, 1, l, f) != l) { free(s); fseek(f, 0, SEEK_SET); return NULL; }
+  s[l] = '\0';
+  return s;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
+  mpc_input_t *i;
+  char *s;
   int res;
 
   if (f == NULL) {
@@ -1350,8 +1921,21 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
 
-  res = mpc_parse_file(filename, f, p, r);
+  s = mpc_file_contents(f);
+
+  if (s == NULL) {
+    res = mpc_parse_file(filename, f, p, r);
+    fclose(f);
+    return res;
+  }
+
   fclose(f);
+
+  i = mpc_input_new_string(filename, s);
+  i->string_owned = 1;
+  i->length = (long)strlen(s);
+  res = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
   return res;
 }
 
@@ -1368,6 +1952,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  mpc_first_delete(p->data.or.first);
 
 }
 
@@ -1429,6 +2014,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -1484,6 +2074,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   p->retained = a->retained;
   p->type = a->type;
   p->data = a->data;
+  p->memo = a->memo;
 
   if (a->name) {
     p->name = malloc(strlen(a->name)+1);
@@ -1530,6 +2121,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      p->data.or.first = NULL;
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1553,6 +2145,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -2183,14 +2780,15 @@ static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
   return mpc_count(num, mpcf_strfold, xs[0], free);
 }
 
+/* Escaped control characters are expected by their escape, so errors never print them raw */
 static mpc_parser_t *mpc_re_escape_char(char c) {
   switch (c) {
-    case 'a': return mpc_char('\a');
-    case 'f': return mpc_char('\f');
-    case 'n': return mpc_char('\n');
-    case 'r': return mpc_char('\r');
-    case 't': return mpc_char('\t');
-    case 'v': return mpc_char('\v');
+    case 'a': return mpc_expect(mpc_char('\a'), "'\\a'");
+    case 'f': return mpc_expect(mpc_char('\f'), "'\\f'");
+    case 'n': return mpc_expect(mpc_char('\n'), "'\\n'");
+    case 'r': return mpc_expect(mpc_char('\r'), "'\\r'");
+    case 't': return mpc_expect(mpc_char('\t'), "'\\t'");
+    case 'v': return mpc_expect(mpc_char('\v'), "'\\v'");
     case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
     case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
     case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
@@ -2276,80 +2874,610 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+
+  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (s[0] == '^' &&
+      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+  for (i = comp; i < strlen(s); i++){
+
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];
+      }
+      i++;
+    }
+
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }
+      }
+    }
+
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+
+  }
+
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+
+  free(x);
+  free(range);
+
+  return out;
+}
+
+/*
+** Static Expected Sets
+**
+** When a parser is known to fail without consuming
+** anything, the errors it produces can be worked out
+** ahead of time. These mirror `mpc_err_or` and
+** `mpc_err_repeat` for errors that all sit at the
+** same position.
+*/
+
+typedef struct {
+  int num;
+  char **expected;
+} mpc_expected_t;
+
+static void mpc_expected_add(mpc_expected_t *x, const char *expected) {
+  int j;
+  for (j = 0; j < x->num; j++) {
+    if (strcmp(x->expected[j], expected) == 0) { return; }
+  }
+  x->expected = realloc(x->expected, sizeof(char*) * (x->num + 1));
+  x->expected[x->num++] = mpc_dfa_memdup(expected, strlen(expected) + 1);
+}
+
+static void mpc_expected_clear(mpc_expected_t *x) {
+  int j;
+  for (j = 0; j < x->num; j++) { free(x->expected[j]); }
+  free(x->expected);
+  x->num = 0;
+  x->expected = NULL;
+}
+
+static void mpc_expected_merge(mpc_expected_t *x, mpc_expected_t *y) {
+  int j;
+  for (j = 0; j < y->num; j++) { mpc_expected_add(x, y->expected[j]); }
+  mpc_expected_clear(y);
+}
+
+static void mpc_expected_repeat(mpc_expected_t *x, const char *prefix) {
+
+  int j;
+  size_t l;
+  char *expect;
+
+  if (x->num == 0) { return; }
+
+  l = strlen(prefix);
+  for (j = 0; j < x->num; j++) { l += strlen(x->expected[j]) + strlen(" or "); }
+
+  expect = malloc(l + 1);
+  strcpy(expect, prefix);
+  for (j = 0; j < x->num; j++) {
+    if (j > 0) { strcat(expect, j == x->num-1 ? " or " : ", "); }
+    strcat(expect, x->expected[j]);
+  }
+
+  mpc_expected_clear(x);
+  x->num = 1;
+  x->expected = malloc(sizeof(char*));
+  x->expected[0] = expect;
+}
+
+/*
+** Compiling Regexes to DFAs
+**
+** The combinator tree built for a regex is read as
+** a Glushkov (position) automaton: every character
+** parser is a position, and for each node we work
+** out if it can match empty, which positions can
+** start and end it, and which positions may follow
+** which. If from every state the positions that can
+** come next accept disjoint sets of bytes, the
+** automaton is already deterministic and has one
+** state per position. The tree then never has two
+** ways to go, so the longest prefix the DFA accepts
+** is exactly what the tree would have matched.
+**
+** The first pass through a `+` gets its own copy of
+** the positions, as giving up there reads "one or
+** more of ..." while giving up on a later pass does
+** not. With that, the errors a successful match has
+** to report depend only on the state it stopped in,
+** and are worked out here by replaying what the tree
+** does when none of the characters it tries next
+** match, using the same rules as `mpc_parse_run`.
+**
+** Regexes outside this subset - anchors, lookahead,
+** counted repeats, ambiguous alternatives or repeats
+** - are left as combinator trees.
+*/
+
+enum {
+  MPC_DFA_POSITIONS_MAX = 64,
+  MPC_DFA_NODES_MAX = 256,
+  MPC_DFA_DEPTH_MAX = 32
+};
+
+typedef unsigned long long mpc_dfa_set_t;
+
+typedef struct {
+  mpc_parser_t *leaf;
+  unsigned int first;
+  unsigned char bytes[32];
+  mpc_dfa_set_t follow;
+} mpc_dfa_position_t;
+
+typedef struct {
+  mpc_parser_t *node;
+  mpc_parser_t *parent;
+  int index;
+  int depth;
+} mpc_dfa_node_t;
+
+typedef struct {
+  int positions;
+  mpc_dfa_position_t position[MPC_DFA_POSITIONS_MAX];
+  int nodes;
+  mpc_dfa_node_t node[MPC_DFA_NODES_MAX];
+} mpc_dfa_builder_t;
+
+typedef struct {
+  int nullable;
+  mpc_dfa_set_t first;
+  mpc_dfa_set_t last;
+} mpc_dfa_frag_t;
+
+
+static int mpc_dfa_nodes(mpc_dfa_builder_t *b, mpc_parser_t *p, mpc_parser_t *parent, int index, int depth) {
+
+  int j;
+  mpc_dfa_node_t *n;
+
+  if (p->retained || b->nodes == MPC_DFA_NODES_MAX || depth == MPC_DFA_DEPTH_MAX) { return 0; }
+
+  n = &b->node[b->nodes++];
+  n->node = p;
+  n->parent = parent;
+  n->index = index;
+  n->depth = depth;
+
+  switch (p->type) {
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_dfa_nodes(b, p->data.and.xs[j], p, j, depth+1)) { return 0; }
+      }
+      return 1;
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_nodes(b, p->data.or.xs[j], p, j, depth+1)) { return 0; }
+      }
+      return 1;
+    case MPC_TYPE_MAYBE: return mpc_dfa_nodes(b, p->data.not.x, p, 0, depth+1);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1: return mpc_dfa_nodes(b, p->data.repeat.x, p, 0, depth+1);
+    default: return 1;
+  }
+}
+
+static mpc_dfa_node_t *mpc_dfa_node(mpc_dfa_builder_t *b, mpc_parser_t *p) {
+  int j;
+  for (j = 0; j < b->nodes; j++) {
+    if (b->node[j].node == p) { return &b->node[j]; }
+  }
+  return NULL;
+}
+
+static int mpc_dfa_matches(mpc_parser_t *p, char c) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:    return 1;
+    case MPC_TYPE_SINGLE: return c == p->data.single.x;
+    case MPC_TYPE_RANGE:  return c >= p->data.range.x && c <= p->data.range.y;
+    case MPC_TYPE_ONEOF:  return strchr(p->data.string.x, c) != 0;
+    case MPC_TYPE_NONEOF: return strchr(p->data.string.x, c) == 0;
+    default: return 0;
+  }
+}
+
+static int mpc_dfa_class(mpc_parser_t *p, unsigned char *set) {
+
+  int b, j;
+
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+    case MPC_TYPE_EXPECT: return mpc_dfa_class(p->data.expect.x, set);
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_class(p->data.or.xs[j], set)) { return 0; }
+      }
+      return p->data.or.n > 0;
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (b = 1; b < 256; b++) {
+        if (mpc_dfa_matches(p, (char)b)) { set[b / 8] |= 1 << (b % 8); }
+      }
+      return 1;
+    default: return 0;
+  }
+}
+
+static int mpc_dfa_leaf(mpc_dfa_builder_t *b, mpc_parser_t *p, unsigned int first, mpc_dfa_frag_t *f) {
+
+  mpc_dfa_position_t *q;
+
+  if (b->positions == MPC_DFA_POSITIONS_MAX) { return 0; }
+
+  q = &b->position[b->positions];
+  memset(q->bytes, 0, sizeof(q->bytes));
+  if (!mpc_dfa_class(p->data.expect.x, q->bytes)) { return 0; }
+
+  q->leaf = p;
+  q->first = first;
+  q->follow = 0;
+
+  f->nullable = 0;
+  f->first = f->last = (mpc_dfa_set_t)1 << b->positions;
+  b->positions++;
+  return 1;
+}
+
+static void mpc_dfa_link(mpc_dfa_builder_t *b, mpc_dfa_set_t from, mpc_dfa_set_t to) {
+  int q;
+  for (q = 0; q < b->positions; q++) {
+    if ((from >> q) & 1) { b->position[q].follow |= to; }
+  }
+}
+
+static int mpc_dfa_build(mpc_dfa_builder_t *b, mpc_parser_t *p, unsigned int first, mpc_dfa_frag_t *f) {
+
+  int j;
+  mpc_dfa_frag_t x;
+
+  f->nullable = 1;
+  f->first = f->last = 0;
+
+  switch (p->type) {
+
+    case MPC_TYPE_EXPECT: return mpc_dfa_leaf(b, p, first, f);
+    case MPC_TYPE_LIFT:   return p->data.lift.lf == mpcf_ctor_str;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_dfa_build(b, p->data.and.xs[j], first, &x)) { return 0; }
+        mpc_dfa_link(b, f->last, x.first);
+        if (f->nullable) { f->first |= x.first; }
+        f->last = x.nullable ? (f->last | x.last) : x.last;
+        f->nullable = f->nullable && x.nullable;
+      }
+      return 1;
+
+    /* An alternative after one matching empty is never tried */
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      f->nullable = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        if (f->nullable || !mpc_dfa_build(b, p->data.or.xs[j], first, &x)) { return 0; }
+        f->nullable = x.nullable;
+        f->first |= x.first;
+        f->last |= x.last;
+      }
+      return 1;
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      if (!mpc_dfa_build(b, p->data.not.x, first, f)) { return 0; }
+      f->nullable = 1;
+      return 1;
+
+    case MPC_TYPE_MANY:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      if (!mpc_dfa_build(b, p->data.repeat.x, first, f) || f->nullable) { return 0; }
+      mpc_dfa_link(b, f->last, f->first);
+      f->nullable = 1;
+      return 1;
+
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      j = mpc_dfa_node(b, p)->depth;
+      if (!mpc_dfa_build(b, p->data.repeat.x, first | (1u << j), f) || f->nullable) { return 0; }
+      if (!mpc_dfa_build(b, p->data.repeat.x, first, &x)) { return 0; }
+      mpc_dfa_link(b, f->last, x.first);
+      mpc_dfa_link(b, x.last, x.first);
+      f->last |= x.last;
+      return 1;
+
+    default: return 0;
+  }
+}
+
+static int mpc_dfa_disjoint(mpc_dfa_builder_t *b, mpc_dfa_set_t next) {
+  int q, k;
+  unsigned char seen[32];
+  memset(seen, 0, sizeof(seen));
+  for (q = 0; q < b->positions; q++) {
+    if (!((next >> q) & 1)) { continue; }
+    for (k = 0; k < 32; k++) {
+      if (seen[k] & b->position[q].bytes[k]) { return 0; }
+      seen[k] |= b->position[q].bytes[k];
+    }
+  }
+  return 1;
+}
+
+/* Run `p` where every character parser fails */
+static int mpc_dfa_fresh(mpc_parser_t *p, mpc_expected_t *err, mpc_expected_t *delta) {
+
+  int j;
+  mpc_expected_t x = { 0, NULL };
+
+  switch (p->type) {
+
+    case MPC_TYPE_EXPECT:
+      mpc_expected_add(err, p->data.expect.m);
+      return 0;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_dfa_fresh(p->data.and.xs[j], err, delta)) { return 0; }
+      }
+      return 1;
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_dfa_fresh(p->data.or.xs[j], &x, delta)) { return 1; }
+        mpc_expected_merge(delta, &x);
+      }
+      return 0;
+
+    case MPC_TYPE_MAYBE:
+      if (!mpc_dfa_fresh(p->data.not.x, &x, delta)) { mpc_expected_merge(delta, &x); }
+      return 1;
+
+    case MPC_TYPE_MANY:
+      if (!mpc_dfa_fresh(p->data.repeat.x, &x, delta)) { mpc_expected_merge(delta, &x); }
+      return 1;
+
+    case MPC_TYPE_MANY1:
+      if (mpc_dfa_fresh(p->data.repeat.x, err, delta)) { return 1; }
+      mpc_expected_repeat(err, "one or more of ");
+      return 0;
+
+    default: return 1;
+  }
+}
+
+/* Carry on from position `q` where every character parser fails */
+static void mpc_dfa_continue(mpc_dfa_builder_t *b, mpc_dfa_position_t *q, mpc_expected_t *delta) {
+
+  int j, failed = 0;
+  mpc_parser_t *p;
+  mpc_dfa_node_t *n = mpc_dfa_node(b, q->leaf);
+  mpc_expected_t err = { 0, NULL }, x = { 0, NULL };
+
+  while (n->parent) {
+
+    p = n->parent;
+
+    if (!failed) {
+
+      if (p->type == MPC_TYPE_AND) {
+        for (j = n->index + 1; j < p->data.and.n && !failed; j++) {
+          failed = !mpc_dfa_fresh(p->data.and.xs[j], &err, delta);
+        }
+      }
+
+      if (p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1) {
+        if (!mpc_dfa_fresh(p->data.repeat.x, &x, delta)) { mpc_expected_merge(delta, &x); }
+      }
+
+    } else {
+
+      /* Past here the tree has rewound to before the stop */
+      if (p->type == MPC_TYPE_MANY1 && (q->first >> (n->depth - 1)) & 1) {
+        mpc_expected_repeat(&err, "one or more of ");
+      } else if (p->type != MPC_TYPE_AND) {
+        mpc_expected_merge(delta, &err);
+        return;
+      }
+
+    }
+
+    n = mpc_dfa_node(b, p);
+  }
+
+  mpc_expected_clear(&err);
+}
+
+static mpc_dfa_t *mpc_dfa_compile(mpc_parser_t *re) {
 
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  int q, c, k, n, st, loops;
+  mpc_dfa_builder_t *b;
+  mpc_dfa_frag_t f;
+  mpc_expected_t err, delta;
+  mpc_dfa_set_t sig, next, csig[256];
+  mpc_dfa_t *d;
+  unsigned char *stop;
 
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  if (s[0] == '^' &&
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  b = malloc(sizeof(mpc_dfa_builder_t));
+  b->positions = 0;
+  b->nodes = 0;
 
-  for (i = comp; i < strlen(s); i++){
+  if (!mpc_dfa_nodes(b, re, NULL, 0, 0)
+  ||  !mpc_dfa_build(b, re, 0, &f)
+  ||  b->positions == 0
+  ||  !mpc_dfa_disjoint(b, f.first)) { free(b); return NULL; }
 
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];
-      }
-      i++;
+  for (q = 0; q < b->positions; q++) {
+    if (!mpc_dfa_disjoint(b, b->position[q].follow)) { free(b); return NULL; }
+  }
+
+  d = malloc(sizeof(mpc_dfa_t));
+  d->states = b->positions + 1;
+
+  /* Class 0 holds every byte no position accepts */
+  d->classes = 1;
+  d->cls[0] = 0;
+  csig[0] = 0;
+  for (c = 1; c < 256; c++) {
+    sig = 0;
+    for (q = 0; q < b->positions; q++) {
+      if ((b->position[q].bytes[c / 8] >> (c % 8)) & 1) { sig |= (mpc_dfa_set_t)1 << q; }
     }
+    for (k = 0; k < d->classes; k++) { if (csig[k] == sig) { break; } }
+    if (k == d->classes) { csig[d->classes++] = sig; }
+    d->cls[c] = k;
+  }
 
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
-        }
+  d->trans = malloc(sizeof(short) * d->states * d->classes);
+  d->accept = malloc(d->states);
+  d->expected_num = malloc(sizeof(int) * d->states);
+  d->expected = malloc(sizeof(char**) * d->states);
+  d->stop_num = malloc(d->states);
+  d->stop = malloc(d->states * MPC_DFA_STOP_MAX);
+
+  for (st = 0; st < d->states; st++) {
+
+    next = st == 0 ? f.first : b->position[st-1].follow;
+    d->accept[st] = st == 0 ? f.nullable : (int)((f.last >> (st-1)) & 1);
+
+    for (k = 0; k < d->classes; k++) {
+      d->trans[st * d->classes + k] = -1;
+      for (q = 0; q < b->positions; q++) {
+        if (((next & csig[k]) >> q) & 1) { d->trans[st * d->classes + k] = q + 1; break; }
       }
     }
 
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+    err.num = delta.num = 0;
+    err.expected = delta.expected = NULL;
+    if (st == 0) { mpc_dfa_fresh(re, &err, &delta); }
+    else { mpc_dfa_continue(b, &b->position[st-1], &delta); }
+    mpc_expected_clear(&err);
+    d->expected_num[st] = delta.num;
+    d->expected[st] = delta.expected;
+
+    n = 0;
+    loops = 0;
+    stop = d->stop + st * MPC_DFA_STOP_MAX;
+    memset(stop, 0, MPC_DFA_STOP_MAX);
+    for (c = 1; c < 256; c++) {
+      if (d->trans[st * d->classes + d->cls[c]] == st) { loops = 1; continue; }
+      if (n < MPC_DFA_STOP_MAX) { stop[n] = c; }
+      n++;
     }
-
+    d->stop_num[st] = loops && n > 0 && n <= MPC_DFA_STOP_MAX ? n : 0;
+    for (k = n; k < MPC_DFA_STOP_MAX; k++) { stop[k] = stop[0]; }
   }
 
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
-
-  free(x);
-  free(range);
+  free(b);
+  return d;
+}
 
-  return out;
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *re) {
+  mpc_parser_t *p;
+  mpc_dfa_t *d = mpc_dfa_compile(re);
+  if (d == NULL) { return re; }
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = re;
+  p->data.dfa.d = d;
+  return p;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
 
-mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+/*
+** The regex compiler costs more to build than most regexes cost to compile
+** with it, so each thread builds it once and keeps it, like its input. The
+** mode of the regex being compiled is read through mpc_re_mode_cur. Both
+** are freed when the thread exits.
+*/
+
+static MPC_THREAD_LOCAL int mpc_re_mode_cur;
+static MPC_THREAD_LOCAL mpc_parser_t *mpc_re_compiler = NULL;
+static MPC_THREAD_LOCAL mpc_parser_t *mpc_re_parsers[5];
+
+static void mpc_thread_free(void *unused) {
+  (void)unused;
+  if (mpc_input_cache) {
+    mpc_input_free(mpc_input_cache);
+    mpc_input_cache = NULL;
+  }
+  if (mpc_re_compiler) {
+    mpc_cleanup(6, mpc_re_compiler, mpc_re_parsers[0], mpc_re_parsers[1],
+      mpc_re_parsers[2], mpc_re_parsers[3], mpc_re_parsers[4]);
+    mpc_re_compiler = NULL;
+  }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+
+static pthread_key_t mpc_thread_key;
+static pthread_once_t mpc_thread_once = PTHREAD_ONCE_INIT;
+
+static void mpc_thread_key_new(void) {
+  pthread_key_create(&mpc_thread_key, mpc_thread_free);
+}
+
+/* have the thread's cached input and regex compiler freed when it exits */
+static void mpc_thread_keep(void) {
+  pthread_once(&mpc_thread_once, mpc_thread_key_new);
+  pthread_setspecific(mpc_thread_key, &mpc_thread_key);
+}
+
+#else
+
+static void mpc_thread_keep(void) { }
+
+#endif
+
+static mpc_parser_t *mpc_re_compiler_get(void) {
 
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
 
+  if (mpc_re_compiler) { return mpc_re_compiler; }
+
   Regex  = mpc_new("regex");
   Term   = mpc_new("term");
   Factor = mpc_new("factor");
@@ -2376,8 +3504,8 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
   mpc_define(Base, mpc_or(4,
     mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
     mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
-    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
+    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mpc_re_mode_cur),
+    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mpc_re_mode_cur)
   ));
 
   mpc_define(Range, mpc_apply(
@@ -2394,7 +3522,25 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
   mpc_optimise(Base);
   mpc_optimise(Range);
 
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+  mpc_re_parsers[0] = Regex;
+  mpc_re_parsers[1] = Term;
+  mpc_re_parsers[2] = Factor;
+  mpc_re_parsers[3] = Base;
+  mpc_re_parsers[4] = Range;
+  mpc_re_compiler = RegexEnclose;
+  mpc_thread_keep();
+  return mpc_re_compiler;
+}
+
+mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+
+  mpc_re_mode_cur = mode;
+
+  if(!mpc_parse("<mpc_re_compiler>", re, mpc_re_compiler_get(), &r)) {
     err_msg = mpc_err_string(r.error);
     err_out = mpc_failf("Invalid Regex: %s", err_msg);
     mpc_err_delete(r.error);
@@ -2402,11 +3548,9 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
     r.output = err_out;
   }
 
-  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
-
   mpc_optimise(r.output);
 
-  return r.output;
+  return mpc_re_dfa(r.output);
 
 }
 
@@ -2700,6 +3844,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     /*mpc_print_unretained(p->data.expect.x, 0);*/
   }
 
+  if (p->type == MPC_TYPE_DFA) { mpc_print_unretained(p->data.dfa.x, 0); }
+
   if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
   if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
 
@@ -2873,28 +4019,95 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
-void mpc_ast_delete(mpc_ast_t *a) {
-
-  int i;
+/*
+** Trees are walked with a stack on the heap, so
+** their depth is bounded by memory rather than by
+** the C stack.
+*/
 
-  if (a == NULL) { return; }
+typedef struct {
+  mpc_ast_t *a;
+  mpc_ast_t *b;
+  int d;
+} mpc_ast_walk_t;
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+typedef struct {
+  int num;
+  int slots;
+  mpc_ast_walk_t *items;
+} mpc_ast_stack_t;
+
+static void mpc_ast_stack_push(mpc_ast_stack_t *s, mpc_ast_t *a, mpc_ast_t *b, int d) {
+  if (s->num == s->slots) {
+    s->slots = s->slots ? s->slots * 2 : 16;
+    s->items = realloc(s->items, sizeof(mpc_ast_walk_t) * s->slots);
   }
+  s->items[s->num].a = a;
+  s->items[s->num].b = b;
+  s->items[s->num].d = d;
+  s->num++;
+}
 
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
   free(a->contents);
   free(a);
+}
+
+void mpc_ast_delete(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_stack_t s = { 0, 0, NULL };
+
+  if (a == NULL) { return; }
+  if (a->children_num == 0) { mpc_ast_delete_no_children(a); return; }
+
+  mpc_ast_stack_push(&s, a, NULL, 0);
+
+  while (s.num) {
+    a = s.items[--s.num].a;
+    for (i = 0; i < a->children_num; i++) {
+      if (a->children[i]) { mpc_ast_stack_push(&s, a->children[i], NULL, 0); }
+    }
+    mpc_ast_delete_no_children(a);
+  }
 
+  free(s.items);
 }
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+static mpc_ast_t *mpc_ast_copy_node(mpc_ast_t *a) {
+  mpc_ast_t *b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  return b;
+}
+
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *b, *root;
+  mpc_ast_stack_t s = { 0, 0, NULL };
+
+  if (a == NULL) { return NULL; }
+
+  root = mpc_ast_copy_node(a);
+  mpc_ast_stack_push(&s, a, root, 0);
+
+  while (s.num) {
+    s.num--;
+    a = s.items[s.num].a;
+    b = s.items[s.num].b;
+    for (i = 0; i < a->children_num; i++) {
+      if (a->children[i] == NULL) { b->children[i] = NULL; continue; }
+      b->children[i] = mpc_ast_copy_node(a->children[i]);
+      mpc_ast_stack_push(&s, a->children[i], b->children[i], 0);
+    }
+  }
+
+  free(s.items);
+  return root;
 }
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
@@ -2948,17 +4161,25 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
 
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 
-  int i;
+  int i, eq = 1;
+  mpc_ast_stack_t s = { 0, 0, NULL };
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
-  if (a->children_num != b->children_num) { return 0; }
+  mpc_ast_stack_push(&s, a, b, 0);
 
-  for (i = 0; i < a->children_num; i++) {
-    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+  while (s.num && eq) {
+    s.num--;
+    a = s.items[s.num].a;
+    b = s.items[s.num].b;
+    if (strcmp(a->tag, b->tag) != 0
+    ||  strcmp(a->contents, b->contents) != 0
+    ||  a->children_num != b->children_num) { eq = 0; break; }
+    for (i = a->children_num-1; i >= 0; i--) {
+      mpc_ast_stack_push(&s, a->children[i], b->children[i], 0);
+    }
   }
 
-  return 1;
+  free(s.items);
+  return eq;
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
@@ -3000,27 +4221,39 @@ mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
 static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   int i;
+  mpc_ast_stack_t s = { 0, 0, NULL };
 
-  if (a == NULL) {
-    fprintf(fp, "NULL\n");
-    return;
-  }
+  mpc_ast_stack_push(&s, a, NULL, d);
 
-  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+  while (s.num) {
 
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
-      (long unsigned int)(a->state.row+1),
-      (long unsigned int)(a->state.col+1),
-      a->contents);
-  } else {
-    fprintf(fp, "%s \n", a->tag);
-  }
+    s.num--;
+    a = s.items[s.num].a;
+    d = s.items[s.num].d;
+
+    if (a == NULL) {
+      fprintf(fp, "NULL\n");
+      continue;
+    }
+
+    for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+
+    if (strlen(a->contents)) {
+      fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+        (long unsigned int)(a->state.row+1),
+        (long unsigned int)(a->state.col+1),
+        a->contents);
+    } else {
+      fprintf(fp, "%s \n", a->tag);
+    }
+
+    for (i = a->children_num-1; i >= 0; i--) {
+      mpc_ast_stack_push(&s, a->children[i], NULL, d+1);
+    }
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_print_depth(a->children[i], d+1, fp);
   }
 
+  free(s.items);
 }
 
 void mpc_ast_print(mpc_ast_t *a) {
@@ -3650,6 +4883,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (st->flags & MPCA_LANG_MEMOISE) { mpc_memoise(left); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
@@ -3849,6 +5083,8 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
 
+  if (p->type == MPC_TYPE_DFA) { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
+
   if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
 
@@ -3880,6 +5116,208 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  if (p->memo) {
+    printf("Memo Hits: %lu\n", mpc_memo_counters.hits);
+    printf("Memo Misses: %lu\n", mpc_memo_counters.misses);
+    printf("Memo Evictions: %lu\n", mpc_memo_counters.evictions);
+  }
+}
+
+/*
+** Memoisation is only safe for parsers whose
+** output is an `mpc_ast_t` (or NULL), as cached
+** results are handed out as fresh AST copies.
+** This holds for every rule built by `mpca_lang`,
+** which is what `MPCA_LANG_MEMOISE` relies on.
+**
+** Pipe inputs cannot skip forward, so memoised
+** parsers run uncached on them.
+*/
+
+void mpc_memoise(mpc_parser_t *p) {
+  p->memo = 1;
+}
+
+mpc_memo_stats_t mpc_memo_stats(void) {
+  return mpc_memo_counters;
+}
+
+void mpc_memo_stats_reset(void) {
+  memset(&mpc_memo_counters, 0, sizeof(mpc_memo_stats_t));
+}
+
+/*
+** First-Set Prediction
+**
+** `mpc_first_fresh` adds to `bytes` every byte that `p`
+** may start with, and works out what `p` does when the
+** next byte is not one of them. It then either succeeds
+** without consuming input, setting `nullable`, or fails
+** with `err`, having merged `delta` into the running
+** error on the way. It returns 0 for parsers it cannot
+** reason about, which are always run.
+*/
+
+enum { MPC_FIRST_DEPTH_MAX = 64 };
+
+static int mpc_first_fresh(mpc_parser_t *p, unsigned char *bytes, int *nullable,
+  mpc_expected_t *err, mpc_expected_t *delta, mpc_parser_t **path, int depth) {
+
+  int j, b;
+  char prefix[32];
+  mpc_expected_t x = { 0, NULL }, y = { 0, NULL };
+
+  if (depth == MPC_FIRST_DEPTH_MAX) { return 0; }
+  for (j = 0; j < depth; j++) {
+    if (path[j] == p) { return 0; }
+  }
+  path[depth] = p;
+  *nullable = 0;
+
+  switch (p->type) {
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+      *nullable = 1;
+      return 1;
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (b = 0; b < 256; b++) {
+        if (mpc_dfa_matches(p, (char)b)) { bytes[b / 8] |= 1 << (b % 8); }
+      }
+      return 1;
+
+    case MPC_TYPE_STRING:
+      b = (unsigned char)p->data.string.x[0];
+      if (b == 0) { *nullable = 1; }
+      bytes[b / 8] |= 1 << (b % 8);
+      return 1;
+
+    /* Inner errors are suppressed */
+    case MPC_TYPE_EXPECT:
+      if (!mpc_first_fresh(p->data.expect.x, bytes, nullable, &x, &y, path, depth+1)) {
+        mpc_expected_clear(&x); mpc_expected_clear(&y);
+        return 0;
+      }
+      mpc_expected_clear(&x); mpc_expected_clear(&y);
+      if (!*nullable) { mpc_expected_add(err, p->data.expect.m); }
+      return 1;
+
+    case MPC_TYPE_APPLY:
+      return mpc_first_fresh(p->data.apply.x, bytes, nullable, err, delta, path, depth+1);
+    case MPC_TYPE_APPLY_TO:
+      return mpc_first_fresh(p->data.apply_to.x, bytes, nullable, err, delta, path, depth+1);
+    case MPC_TYPE_PREDICT:
+      return mpc_first_fresh(p->data.predict.x, bytes, nullable, err, delta, path, depth+1);
+    case MPC_TYPE_DFA:
+      return mpc_first_fresh(p->data.dfa.x, bytes, nullable, err, delta, path, depth+1);
+
+    /* A check may still fail on an empty match */
+    case MPC_TYPE_CHECK:
+      return mpc_first_fresh(p->data.check.x, bytes, nullable, err, delta, path, depth+1) && !*nullable;
+    case MPC_TYPE_CHECK_WITH:
+      return mpc_first_fresh(p->data.check_with.x, bytes, nullable, err, delta, path, depth+1) && !*nullable;
+
+    case MPC_TYPE_MAYBE:
+      if (!mpc_first_fresh(p->data.not.x, bytes, nullable, &x, delta, path, depth+1)) {
+        mpc_expected_clear(&x);
+        return 0;
+      }
+      mpc_expected_merge(delta, &x);
+      *nullable = 1;
+      return 1;
+
+    case MPC_TYPE_MANY:
+      if (!mpc_first_fresh(p->data.repeat.x, bytes, nullable, &x, delta, path, depth+1)) {
+        mpc_expected_clear(&x);
+        return 0;
+      }
+      mpc_expected_merge(delta, &x);
+      *nullable = 1;
+      return 1;
+
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n <= 0) { return 0; }
+      if (!mpc_first_fresh(p->data.repeat.x, bytes, nullable, err, delta, path, depth+1)) {
+        return 0;
+      }
+      if (p->type == MPC_TYPE_MANY1) {
+        mpc_expected_repeat(err, "one or more of ");
+      } else {
+        sprintf(prefix, "%i of ", p->data.repeat.n);
+        mpc_expected_repeat(err, prefix);
+      }
+      return 1;
+
+    /* Alternatives after one that succeeds are never run */
+    case MPC_TYPE_OR:
+      *nullable = p->data.or.n == 0;
+      for (j = 0; j < p->data.or.n && !*nullable; j++) {
+        if (!mpc_first_fresh(p->data.or.xs[j], bytes, nullable, &x, delta, path, depth+1)) {
+          mpc_expected_clear(&x);
+          return 0;
+        }
+        mpc_expected_merge(delta, &x);
+      }
+      return 1;
+
+    /* Only the parts that run before a failure */
+    case MPC_TYPE_AND:
+      *nullable = 1;
+      for (j = 0; j < p->data.and.n && *nullable; j++) {
+        if (!mpc_first_fresh(p->data.and.xs[j], bytes, nullable, err, delta, path, depth+1)) {
+          return 0;
+        }
+      }
+      return 1;
+
+    default: return 0;
+  }
+
+}
+
+static void mpc_first_build(mpc_parser_t *p) {
+
+  int j, nullable, skip = 0;
+  mpc_first_t *f;
+  mpc_parser_t *path[MPC_FIRST_DEPTH_MAX];
+  mpc_expected_t err, delta;
+
+  mpc_first_delete(p->data.or.first);
+  p->data.or.first = NULL;
+
+  f = malloc(sizeof(mpc_first_t));
+  f->n = p->data.or.n;
+  f->skip = calloc(f->n, 1);
+  f->bytes = calloc(f->n, 32);
+  f->expected_num = calloc(f->n, sizeof(int));
+  f->expected = calloc(f->n, sizeof(char**));
+
+  path[0] = p;
+  for (j = 0; j < f->n; j++) {
+    err.num = delta.num = 0;
+    err.expected = delta.expected = NULL;
+    if (mpc_first_fresh(p->data.or.xs[j], f->bytes[j], &nullable, &err, &delta, path, 1)
+    && !nullable) {
+      mpc_expected_merge(&delta, &err);
+      f->skip[j] = 1;
+      f->expected_num[j] = delta.num;
+      f->expected[j] = delta.expected;
+      skip = 1;
+    } else {
+      mpc_expected_clear(&err);
+      mpc_expected_clear(&delta);
+    }
+  }
+
+  if (skip) { p->data.or.first = f; } else { mpc_first_delete(f); }
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3928,6 +5366,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_first_delete(t->data.or.first);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
@@ -3942,6 +5381,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_first_delete(t->data.or.first);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
@@ -4045,13 +5485,54 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
-    return;
+    break;
 
   }
 
+  /* Alternatives may have moved */
+  if (p->type == MPC_TYPE_OR && p->data.or.first) { mpc_first_build(p); }
+
 }
 
 void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
 }
 
+static void mpc_first_unretained(mpc_parser_t *p, int force) {
+
+  int i;
+
+  if (p->retained && !force) { return; }
+
+  if (p->type == MPC_TYPE_EXPECT)     { mpc_first_unretained(p->data.expect.x, 0); }
+  if (p->type == MPC_TYPE_APPLY)      { mpc_first_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_first_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_CHECK)      { mpc_first_unretained(p->data.check.x, 0); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_first_unretained(p->data.check_with.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)    { mpc_first_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_NOT)        { mpc_first_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE)      { mpc_first_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MANY)       { mpc_first_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1)      { mpc_first_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT)      { mpc_first_unretained(p->data.repeat.x, 0); }
+
+  if (p->type == MPC_TYPE_OR) {
+    for(i = 0; i < p->data.or.n; i++) {
+      mpc_first_unretained(p->data.or.xs[i], 0);
+    }
+    mpc_first_build(p);
+  }
+
+  if (p->type == MPC_TYPE_AND) {
+    for(i = 0; i < p->data.and.n; i++) {
+      mpc_first_unretained(p->data.and.xs[i], 0);
+    }
+  }
+
+}
+
+void mpc_optimise_first(mpc_parser_t *p) {
+  mpc_optimise_unretained(p, 1);
+  mpc_first_unretained(p, 1);
+}
+
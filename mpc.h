@@ -353,7 +353,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_MEMOISE              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -372,6 +373,31 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+/*
+** First-Set Prediction
+**
+** Optimises `p` and lets each of its `or` parsers skip
+** alternatives that cannot start with the next byte.
+** Call it once every rule `p` refers to is defined, and
+** again if any of them is redefined.
+*/
+
+void mpc_optimise_first(mpc_parser_t *p);
+
+/*
+** Packrat Memoisation
+*/
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} mpc_memo_stats_t;
+
+void mpc_memoise(mpc_parser_t *p);
+mpc_memo_stats_t mpc_memo_stats(void);
+void mpc_memo_stats_reset(void);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 
   mpc_dtor_t destructor, 
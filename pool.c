@@ -0,0 +1,378 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "pool.h"
+
+// stack size of every thread started here, set explicitly so evaluation on
+// them gets the same room as on a main thread, whatever the default
+#define LPOOL_STACK (8 * 1024 * 1024)
+
+// function to start a thread with LPOOL_STACK of stack
+static int lpool_spawn(pthread_t* t, void* (*run)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LPOOL_STACK);
+    int failed = pthread_create(t, &attr, run, arg);
+    pthread_attr_destroy(&attr);
+    return failed;
+}
+
+// the indices a worker has still to run, [lo, hi); the owner takes from
+// the top and thieves take the lower half
+typedef struct {
+    pthread_mutex_t lock;
+    int lo;
+    int hi;
+} ldeque;
+
+struct lpool {
+    int size;
+    pthread_t* threads;
+    ldeque* deques;
+
+    // current batch, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_mutex_t busy;
+    unsigned long batch;
+    int finished;
+    int quit;
+    ltask task;
+    void* ctx;
+};
+
+typedef struct {
+    lpool* pool;
+    int w;
+} lworker;
+
+int lpool_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (int)n;
+}
+
+// function to take the next index from a worker's own deque, or -1
+static int ldeque_pop(ldeque* d) {
+    int i = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->lo < d->hi) { i = --d->hi; }
+    pthread_mutex_unlock(&d->lock);
+    return i;
+}
+
+// function to steal the lower half of another worker's deque into our own,
+// returning the first stolen index, or -1 if every deque is empty
+static int lpool_steal(lpool* p, int w) {
+    for (int k = 1; k < p->size; k++) {
+        ldeque* v = &p->deques[(w + k) % p->size];
+        pthread_mutex_lock(&v->lock);
+        int n = v->hi - v->lo;
+        if (n <= 0) {
+            pthread_mutex_unlock(&v->lock);
+            continue;
+        }
+        int lo = v->lo;
+        int hi = lo + (n + 1) / 2;
+        v->lo = hi;
+        pthread_mutex_unlock(&v->lock);
+
+        // keep all but the first of the stolen indices
+        ldeque* d = &p->deques[w];
+        pthread_mutex_lock(&d->lock);
+        d->lo = lo + 1;
+        d->hi = hi;
+        pthread_mutex_unlock(&d->lock);
+        return lo;
+    }
+    return -1;
+}
+
+// function to run tasks on worker w until no work is left anywhere
+static void lpool_work(lpool* p, int w) {
+    ldeque* d = &p->deques[w];
+    int i;
+    while ((i = ldeque_pop(d)) >= 0 || (i = lpool_steal(p, w)) >= 0) {
+        p->task(p->ctx, i, w);
+    }
+}
+
+static void* lpool_thread(void* arg) {
+    lworker* wk = arg;
+    lpool* p = wk->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->quit && p->batch == seen) {
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        if (p->quit) { break; }
+        seen = p->batch;
+        pthread_mutex_unlock(&p->lock);
+
+        lpool_work(p, wk->w);
+
+        pthread_mutex_lock(&p->lock);
+        if (++p->finished == p->size - 1) {
+            pthread_cond_signal(&p->done);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    free(wk);
+    return NULL;
+}
+
+lpool* lpool_new(int workers) {
+    lpool* p = malloc(sizeof(lpool));
+    p->size = workers < 1 ? 1 : workers;
+    p->threads = malloc(sizeof(pthread_t) * p->size);
+    p->deques = malloc(sizeof(ldeque) * p->size);
+    p->batch = 0;
+    p->finished = 0;
+    p->quit = 0;
+    p->task = NULL;
+    p->ctx = NULL;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_init(&p->busy, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (int w = 0; w < p->size; w++) {
+        pthread_mutex_init(&p->deques[w].lock, NULL);
+        p->deques[w].lo = p->deques[w].hi = 0;
+    }
+
+    // worker 0 is whichever thread calls lpool_run
+    for (int w = 1; w < p->size; w++) {
+        lworker* wk = malloc(sizeof(lworker));
+        wk->pool = p;
+        wk->w = w;
+        if (lpool_spawn(&p->threads[w], lpool_thread, wk) != 0) {
+            // run with the threads we have
+            free(wk);
+            p->size = w;
+            break;
+        }
+    }
+
+    return p;
+}
+
+void lpool_del(lpool* p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int w = 1; w < p->size; w++) {
+        pthread_join(p->threads[w], NULL);
+    }
+    for (int w = 0; w < p->size; w++) {
+        pthread_mutex_destroy(&p->deques[w].lock);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->busy);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p->deques);
+    free(p->threads);
+    free(p);
+}
+
+int lpool_size(lpool* p) { return p->size; }
+
+void lpool_run(lpool* p, int n, ltask task, void* ctx) {
+    // small batches, single workers and nested batches run inline
+    if (n <= 1 || p->size == 1 || pthread_mutex_trylock(&p->busy) != 0) {
+        for (int i = 0; i < n; i++) { task(ctx, i, 0); }
+        return;
+    }
+
+    // deal the indices out in contiguous runs, one per worker
+    for (int w = 0; w < p->size; w++) {
+        ldeque* d = &p->deques[w];
+        pthread_mutex_lock(&d->lock);
+        d->lo = (int)((long)n * w / p->size);
+        d->hi = (int)((long)n * (w + 1) / p->size);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->task = task;
+    p->ctx = ctx;
+    p->finished = 0;
+    p->batch++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    lpool_work(p, 0);
+
+    // wait until every worker has left the batch
+    pthread_mutex_lock(&p->lock);
+    while (p->finished < p->size - 1) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_mutex_unlock(&p->busy);
+}
+
+
+// a job waiting in an executor's queue
+typedef struct lqueued {
+    ljob job;
+    void* ctx;
+    struct lqueued* next;
+} lqueued;
+
+struct lexec {
+    int size;
+    pthread_t* threads;
+
+    // the queue, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    lqueued* head;
+    lqueued* tail;
+    int quit;
+};
+
+static void* lexec_thread(void* arg) {
+    lexec* x = arg;
+
+    pthread_mutex_lock(&x->lock);
+    while (1) {
+        while (!x->quit && !x->head) {
+            pthread_cond_wait(&x->ready, &x->lock);
+        }
+        // only stop once the queue is drained
+        if (!x->head) { break; }
+
+        lqueued* q = x->head;
+        x->head = q->next;
+        if (!x->head) { x->tail = NULL; }
+        pthread_mutex_unlock(&x->lock);
+
+        q->job(q->ctx);
+        free(q);
+
+        pthread_mutex_lock(&x->lock);
+    }
+    pthread_mutex_unlock(&x->lock);
+
+    return NULL;
+}
+
+lexec* lexec_new(int threads) {
+    lexec* x = malloc(sizeof(lexec));
+    x->size = threads < 1 ? 1 : threads;
+    x->threads = malloc(sizeof(pthread_t) * x->size);
+    x->head = NULL;
+    x->tail = NULL;
+    x->quit = 0;
+    pthread_mutex_init(&x->lock, NULL);
+    pthread_cond_init(&x->ready, NULL);
+
+    for (int t = 0; t < x->size; t++) {
+        if (lpool_spawn(&x->threads[t], lexec_thread, x) != 0) {
+            // run with the threads we have, or inline if there are none
+            x->size = t;
+            break;
+        }
+    }
+
+    return x;
+}
+
+void lexec_del(lexec* x) {
+    pthread_mutex_lock(&x->lock);
+    x->quit = 1;
+    pthread_cond_broadcast(&x->ready);
+    pthread_mutex_unlock(&x->lock);
+
+    for (int t = 0; t < x->size; t++) {
+        pthread_join(x->threads[t], NULL);
+    }
+
+    pthread_mutex_destroy(&x->lock);
+    pthread_cond_destroy(&x->ready);
+    free(x->threads);
+    free(x);
+}
+
+void lexec_submit(lexec* x, ljob job, void* ctx) {
+    if (x->size == 0) {
+        job(ctx);
+        return;
+    }
+
+    lqueued* q = malloc(sizeof(lqueued));
+    q->job = job;
+    q->ctx = ctx;
+    q->next = NULL;
+
+    pthread_mutex_lock(&x->lock);
+    if (x->tail) { x->tail->next = q; } else { x->head = q; }
+    x->tail = q;
+    pthread_cond_signal(&x->ready);
+    pthread_mutex_unlock(&x->lock);
+}
+
+
+// Vyukov's intrusive MPSC queue: producers swap themselves in as the head
+// and then link the previous head to themselves; the consumer follows the
+// links from the tail, with a stub node standing in when the queue drains
+
+void lmpsc_init(lmpsc* q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+void lmpsc_push(lmpsc* q, lnode* n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    lnode* prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+lnode* lmpsc_pop(lmpsc* q) {
+    lnode* tail = q->tail;
+    lnode* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    // step over the stub
+    if (tail == &q->stub) {
+        if (!next) { return NULL; }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    // tail is the last node unless a push is still linking in behind it
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) { return NULL; }
+
+    // put the stub back behind the last node so it can be handed out
+    lmpsc_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+lnode* lmpsc_pop_wait(lmpsc* q) {
+    lnode* n;
+    while (!(n = lmpsc_pop(q))) { sched_yield(); }
+    return n;
+}
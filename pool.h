@@ -0,0 +1,71 @@
+#ifndef POOL_HEADER
+#define POOL_HEADER
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a fixed-size pool of worker threads running batches of indexed tasks;
+// every worker owns a deque of task indices and steals from the others
+// once its own runs dry
+typedef struct lpool lpool;
+
+// a task handles index i on worker w, where 0 <= w < lpool_size
+typedef void (*ltask)(void* ctx, int i, int w);
+
+lpool* lpool_new(int workers);
+
+void lpool_del(lpool* p);
+
+int lpool_size(lpool* p);
+
+// run task for every index in [0, n) and wait for all of them to finish;
+// the calling thread works as worker 0, and a batch started while another
+// is running (for example from inside a task) runs inline on worker 0
+void lpool_run(lpool* p, int n, ltask task, void* ctx);
+
+// a queue of jobs run in the background, in order of submission, by a
+// fixed set of threads
+typedef struct lexec lexec;
+
+typedef void (*ljob)(void* ctx);
+
+lexec* lexec_new(int threads);
+
+// finish every queued job, then stop the threads
+void lexec_del(lexec* x);
+
+void lexec_submit(lexec* x, ljob job, void* ctx);
+
+// an intrusive lock-free queue with many producers and a single consumer;
+// embed an lnode as the first member of the queued struct
+typedef struct lnode {
+    struct lnode* next;
+} lnode;
+
+typedef struct {
+    lnode* head;    // last pushed, swapped in by producers
+    lnode* tail;    // next to pop, owned by the consumer
+    lnode stub;
+} lmpsc;
+
+void lmpsc_init(lmpsc* q);
+
+// push a node, from any thread
+void lmpsc_push(lmpsc* q, lnode* n);
+
+// pop the oldest node, from the consumer only; NULL when the queue is empty
+// or the next push is still in progress
+lnode* lmpsc_pop(lmpsc* q);
+
+// pop a node the caller knows has been pushed, waiting out a push in progress
+lnode* lmpsc_pop_wait(lmpsc* q);
+
+// number of processors online, at least 1
+int lpool_cpus(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serve.h"
+
+// Batch evaluation server. Clients send requests framed as a 4 byte
+// big-endian length followed by that many bytes of source, which is
+// evaluated like a REPL line; the reply uses the same framing and holds
+// everything printed, followed by the printed value. One thread does all
+// socket I/O with epoll and hands complete requests to worker threads,
+// each with a warm interpreter. A connection has at most one request in
+// flight, so replies come back in order. The interpreters share one pool
+// and executor for their parallel builtins, futures and actors, so the
+// server runs one set of those threads however many workers it has.
+
+// largest request accepted, bigger ones close the connection
+#define SERVE_REQUEST_MAX (64 * 1024 * 1024)
+
+typedef struct sconn sconn;
+
+typedef struct {
+    int epfd;
+    int wakefd;
+    lexec* exec;
+
+    // idle interpreters, and connections with a finished reply, under lock
+    pthread_mutex_t lock;
+    interp** idle;
+    int idle_count;
+    sconn* done;
+
+    // connections closed while handling a batch of events, freed after it
+    // so later events in the batch never see freed memory
+    sconn* dead;
+} server;
+
+struct sconn {
+    server* s;
+    int fd;
+    int busy;       // a request is being evaluated
+    int closed;     // the client went away
+    sconn* next_done;
+    sconn* next_dead;
+
+    // bytes read but not yet taken as a request
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+
+    // reply bytes not yet written
+    char* out;
+    size_t out_len;
+    size_t out_cap;
+    size_t out_pos;
+
+    // the request being evaluated and its reply
+    char* request;
+    char* reply;
+    size_t reply_len;
+};
+
+
+// function to make room for n more bytes in a growable buffer
+static void serve_reserve(char** buf, size_t* cap, size_t len, size_t n) {
+    if (len + n <= *cap) { return; }
+    while (len + n > *cap) { *cap = *cap ? *cap * 2 : 4096; }
+    *buf = realloc(*buf, *cap);
+}
+
+
+// function to evaluate one request in an environment of its own on top of
+// the interpreter's globals, which takes its definitions, capturing
+// everything printed by it and by the futures and actors it starts
+static void serve_eval(interp* in, char* input, char** reply, size_t* reply_len) {
+    FILE* out = open_memstream(reply, reply_len);
+    FILE* old = lval_output(out);
+
+    mpc_result_t r;
+    if (mpc_parse("<request>", input, in->lispy, &r)) {
+        lenv* e = lenv_new();
+        e->par = in->env;
+        e->top = 1;
+        lval* x = interp_eval_scoped(in, e, lval_read(r.output), out);
+        lval_println(x);
+        lval_del(x);
+        lenv_del(e);
+        mpc_ast_delete(r.output);
+    } else {
+        char* err_msg = mpc_err_string(r.error);
+        fputs(err_msg, out);
+        free(err_msg);
+        mpc_err_delete(r.error);
+    }
+
+    lval_output(old);
+    fclose(out);
+}
+
+
+// job evaluating a connection's request on a worker thread
+static void serve_job(void* ctx) {
+    sconn* c = ctx;
+    server* s = c->s;
+
+    pthread_mutex_lock(&s->lock);
+    interp* in = s->idle[--s->idle_count];
+    pthread_mutex_unlock(&s->lock);
+
+    serve_eval(in, c->request, &c->reply, &c->reply_len);
+    free(c->request);
+    c->request = NULL;
+
+    // hand the reply back to the I/O thread
+    pthread_mutex_lock(&s->lock);
+    s->idle[s->idle_count++] = in;
+    c->next_done = s->done;
+    s->done = c;
+    pthread_mutex_unlock(&s->lock);
+
+    uint64_t one = 1;
+    if (write(s->wakefd, &one, sizeof(one)) < 0) { perror("serve: write"); }
+}
+
+
+static void serve_free(sconn* c) {
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+
+// function to free a closed connection once the current batch of events
+// is handled
+static void serve_bury(sconn* c) {
+    c->next_dead = c->s->dead;
+    c->s->dead = c;
+}
+
+
+static void serve_close(sconn* c) {
+    if (c->closed) { return; }
+    epoll_ctl(c->s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->closed = 1;
+    // a busy connection is freed once its reply comes back
+    if (!c->busy) { serve_bury(c); }
+}
+
+
+// function to wait for the events the connection can handle: more input
+// unless a full request is already buffered behind the one being evaluated,
+// and writability while some of the reply is left to write
+static void serve_watch(sconn* c) {
+    struct epoll_event ev = { .events = 0, .data.ptr = c };
+    if (c->in_len <= 4 + SERVE_REQUEST_MAX) { ev.events |= EPOLLIN; }
+    if (c->out_pos < c->out_len) { ev.events |= EPOLLOUT; }
+    epoll_ctl(c->s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+// function to write as much of the pending reply as the socket takes,
+// returning 0 if the connection failed
+static int serve_flush(sconn* c) {
+    while (c->out_pos < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+        if (n <= 0) { return 0; }
+        c->out_pos += n;
+    }
+
+    if (c->out_pos == c->out_len) { c->out_len = c->out_pos = 0; }
+    serve_watch(c);
+    return 1;
+}
+
+
+// function to start evaluating the next buffered request, if it is complete,
+// returning 0 if the connection sent a bad frame
+static int serve_dispatch(sconn* c) {
+    if (c->busy || c->in_len < 4) { return 1; }
+
+    unsigned char* h = (unsigned char*)c->in;
+    size_t n = ((size_t)h[0] << 24) | ((size_t)h[1] << 16) | ((size_t)h[2] << 8) | h[3];
+    if (n > SERVE_REQUEST_MAX) { return 0; }
+    if (c->in_len < 4 + n) { return 1; }
+
+    c->request = malloc(n + 1);
+    memcpy(c->request, c->in + 4, n);
+    c->request[n] = '\0';
+    memmove(c->in, c->in + 4 + n, c->in_len - 4 - n);
+    c->in_len -= 4 + n;
+
+    c->busy = 1;
+    lexec_submit(c->s->exec, serve_job, c);
+    return 1;
+}
+
+
+// function to queue a finished reply behind its length
+static void serve_reply(sconn* c) {
+    size_t n = c->reply_len;
+    serve_reserve(&c->out, &c->out_cap, c->out_len, 4 + n);
+    unsigned char* h = (unsigned char*)c->out + c->out_len;
+    h[0] = n >> 24; h[1] = n >> 16; h[2] = n >> 8; h[3] = n;
+    memcpy(c->out + c->out_len + 4, c->reply, n);
+    c->out_len += 4 + n;
+
+    free(c->reply);
+    c->reply = NULL;
+    c->busy = 0;
+}
+
+
+// function to read what the client sent, stopping once the buffer holds
+// more than the largest request until the one being evaluated is done
+static void serve_read(sconn* c) {
+    while (c->in_len <= 4 + SERVE_REQUEST_MAX) {
+        serve_reserve(&c->in, &c->in_cap, c->in_len, 4096);
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+        if (n <= 0) {
+            serve_close(c);
+            return;
+        }
+        c->in_len += n;
+    }
+    if (!serve_dispatch(c)) { serve_close(c); }
+    else { serve_watch(c); }
+}
+
+
+// function to delete the interpreters built so far and the pool and
+// executor they share, once nothing is left running on them
+static void serve_idle_del(interp** idle, int count, lpool* pool, lexec* jobs) {
+    lexec_del(jobs);
+    for (int i = 0; i < count; i++) { interp_del(idle[i]); }
+    lpool_del(pool);
+    free(idle);
+}
+
+
+int lispy_serve(char* path, int workers, llimits* limits, char* image) {
+    // build every interpreter up front so no request pays for the grammar
+    // or the image
+    interp** idle = malloc(sizeof(interp*) * workers);
+    lpool* pool = lpool_new(lpool_cpus());
+    lexec* jobs = lexec_new(lpool_cpus());
+    for (int i = 0; i < workers; i++) {
+        idle[i] = interp_new();
+        interp_share(idle[i], pool, jobs);
+        if (limits) { interp_limit(idle[i], limits); }
+        lval* x = image ? interp_load_image(idle[i], image) : NULL;
+        if (x && lval_type(x) == LVAL_ERR) {
+            fprintf(stderr, "serve: %s\n", lval_to_str(x));
+            lval_del(x);
+            serve_idle_del(idle, i + 1, pool, jobs);
+            return 1;
+        }
+        if (x) { lval_del(x); }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "serve: cannot use socket '%s'\n", path);
+        if (fd >= 0) { close(fd); }
+        serve_idle_del(idle, workers, pool, jobs);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        perror("serve");
+        close(fd);
+        serve_idle_del(idle, workers, pool, jobs);
+        return 1;
+    }
+
+    // a client hanging up mid-reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    server s;
+    s.epfd = epoll_create1(EPOLL_CLOEXEC);
+    s.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s.exec = lexec_new(workers);
+    pthread_mutex_init(&s.lock, NULL);
+    s.done = NULL;
+    s.dead = NULL;
+
+    s.idle = idle;
+    s.idle_count = workers;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, fd, &ev);
+    ev.data.ptr = &s;
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.wakefd, &ev);
+
+    fprintf(stderr, "serving on %s with %d workers\n", path, workers);
+
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(s.epfd, events, 64, -1);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0) {
+            perror("serve: epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void* p = events[i].data.ptr;
+
+            // new connections
+            if (p == NULL) {
+                int cfd;
+                while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    sconn* c = calloc(1, sizeof(sconn));
+                    c->s = &s;
+                    c->fd = cfd;
+                    struct epoll_event cev = { .events = EPOLLIN, .data.ptr = c };
+                    epoll_ctl(s.epfd, EPOLL_CTL_ADD, cfd, &cev);
+                }
+                continue;
+            }
+
+            // finished replies
+            if (p == &s) {
+                uint64_t count;
+                if (read(s.wakefd, &count, sizeof(count)) < 0) { /* spurious wakeup */ }
+
+                pthread_mutex_lock(&s.lock);
+                sconn* done = s.done;
+                s.done = NULL;
+                pthread_mutex_unlock(&s.lock);
+
+                while (done) {
+                    sconn* c = done;
+                    done = c->next_done;
+                    serve_reply(c);
+                    if (c->closed) {
+                        serve_bury(c);
+                    } else if (!serve_dispatch(c) || !serve_flush(c)) {
+                        serve_close(c);
+                    }
+                }
+                continue;
+            }
+
+            sconn* c = p;
+            if (c->closed) { continue; }
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                serve_close(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (!serve_flush(c)) {
+                    serve_close(c);
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLIN) { serve_read(c); }
+        }
+
+        while (s.dead) {
+            sconn* c = s.dead;
+            s.dead = c->next_dead;
+            serve_free(c);
+        }
+    }
+
+    lexec_del(s.exec);
+    serve_idle_del(s.idle, workers, pool, jobs);
+    pthread_mutex_destroy(&s.lock);
+    close(s.wakefd);
+    close(s.epfd);
+    close(fd);
+    unlink(path);
+    return 1;
+}
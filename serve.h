@@ -0,0 +1,20 @@
+#ifndef SERVE_HEADER
+#define SERVE_HEADER
+
+#include "lispy.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// serve requests on a Unix socket with one warm interpreter per worker,
+// each evaluating under limits unless NULL and starting from a heap image
+// unless image is NULL, see serve.c; only returns on failure. the server is
+// part of the lispy program rather than of liblispy
+int lispy_serve(char* path, int workers, llimits* limits, char* image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif